@@ -0,0 +1,1225 @@
+/*
+ * cspeech - Speech document (SSML, SRGS, NLSML) modelling and matching for C
+ * Copyright (C) 2013, Grasshopper
+ *
+ * License: MIT
+ *
+ * Contributor(s):
+ * Chris Rienzo <chris.rienzo@grasshopper.com>
+ *
+ * fsm.cc -- Finite state machines for matching SRGS
+ *
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "srgs.h"
+#include "fsm.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define FSM_HAVE_AVX2 1
+#endif
+
+/** inputs stepped together by each vector */
+#define FSM_LANES 8
+
+/** vectors interleaved to hide gather latency */
+#define FSM_VECTORS 2
+
+/** inputs packed together for the vector lanes */
+#define FSM_CHUNK 256
+
+/** true if vector instructions may be used */
+static int fsm_simd = 0;
+
+/**
+ * A thread of execution in the NFA program
+ */
+struct fsm_thread {
+  /** instruction to execute */
+  int pc;
+  /** lowest <tag> number consumed so far, 0 if none */
+  int tag;
+  /** repeats counted by each program counter */
+  std::vector<int> counts;
+};
+
+/**
+ * Ordered set of threads.  This is a DFA state while building.
+ */
+typedef std::vector<struct fsm_thread> fsm_thread_list;
+
+/**
+ * @param prog the program
+ * @return the memory used by the program in bytes
+ */
+size_t fsm_program_size(const struct fsm_program *prog)
+{
+  return sizeof(*prog) + prog->insts.capacity() * sizeof(struct fsm_inst) + prog->counters.capacity() * sizeof(struct fsm_counter);
+}
+
+/**
+ * Add instruction to program
+ * @param prog the program
+ * @param op the opcode
+ * @param c the character to consume
+ * @param tag the enclosing tag
+ * @param x the target
+ * @param y the alternate target
+ * @return the instruction address
+ */
+int fsm_program_emit(struct fsm_program *prog, enum fsm_opcode op, unsigned char c, int tag, int x, int y)
+{
+  struct fsm_inst inst;
+  inst.op = op;
+  inst.c = c;
+  inst.tag = tag;
+  inst.x = x;
+  inst.y = y;
+  prog->insts.push_back(inst);
+  return prog->insts.size() - 1;
+}
+
+/**
+ * Configurations already reached while following threads
+ */
+struct fsm_visited {
+  /** instructions reached when equal to mark, if the program has no counters */
+  std::vector<int> marks;
+  /** the current mark */
+  int mark;
+  /** instructions and counts reached, if the program has counters */
+  std::set<std::pair<int,std::vector<int> > > reached;
+};
+
+/**
+ * Start a new set of reached configurations
+ * @param visited the configurations
+ */
+static void visited_next(struct fsm_visited &visited)
+{
+  if (visited.mark == INT_MAX) {
+    /* long input, start marking over */
+    visited.marks.assign(visited.marks.size(), 0);
+    visited.mark = 0;
+  }
+  visited.mark++;
+  visited.reached.clear();
+}
+
+/**
+ * Mark a configuration reached
+ * @param prog the program
+ * @param visited the configurations
+ * @param pc the instruction
+ * @param counts the repeat counts
+ * @return true if the configuration was not reached before
+ */
+static int visit(const struct fsm_program *prog, struct fsm_visited &visited, int pc, const std::vector<int> &counts)
+{
+  if (prog->counters.empty()) {
+    if (visited.marks[pc] == visited.mark) {
+      return 0;
+    }
+    visited.marks[pc] = visited.mark;
+    return 1;
+  }
+  return visited.reached.insert(std::make_pair(pc, counts)).second;
+}
+
+/**
+ * Follow FOP_REPEAT or FOP_COUNT.  Counts of unbounded repeats stop
+ * at the minimum and counters are cleared when leaving a repeat so
+ * equivalent threads have equal counts.
+ * @param prog the program
+ * @param inst the instruction
+ * @param pc set to the next instruction
+ * @param counts the repeat counts to update
+ * @param alternate set to the lower priority next instruction, -1 if none
+ */
+static void follow_counter(const struct fsm_program *prog, const struct fsm_inst *inst, int *pc, std::vector<int> &counts, int *alternate)
+{
+  const struct fsm_counter *counter = &prog->counters[inst->tag];
+  int count = counts[inst->tag];
+  *alternate = -1;
+  if (inst->op == FOP_COUNT) {
+    if (count < (counter->max == INT_MAX ? counter->min : counter->max)) {
+      counts[inst->tag]++;
+    }
+    *pc = inst->x;
+  } else if (count < counter->max) {
+    /* greedy - prefer another repeat */
+    *pc = inst->x;
+    if (count >= counter->min) {
+      *alternate = inst->y;
+    }
+  } else {
+    counts[inst->tag] = 0;
+    *pc = inst->y;
+  }
+}
+
+/**
+ * Follow thread through jumps, splits and counters, adding each
+ * reachable CHAR or MATCH instruction to threads in priority order.
+ * @param prog the program
+ * @param visited configurations already added
+ * @param threads the list to add to
+ * @param thread the thread to follow
+ */
+static void add_thread(const struct fsm_program *prog, struct fsm_visited &visited, fsm_thread_list &threads, const struct fsm_thread &thread)
+{
+  std::vector<struct fsm_thread> stack;
+  stack.push_back(thread);
+  while (!stack.empty()) {
+    struct fsm_thread t = stack.back();
+    const struct fsm_inst *inst;
+    stack.pop_back();
+    if (!visit(prog, visited, t.pc, t.counts)) {
+      /* a higher priority thread already got here */
+      continue;
+    }
+    inst = &prog->insts[t.pc];
+    switch (inst->op) {
+      case FOP_JMP:
+        t.pc = inst->x;
+        stack.push_back(t);
+        break;
+      case FOP_SPLIT:
+        t.pc = inst->y;
+        stack.push_back(t);
+        t.pc = inst->x;
+        stack.push_back(t);
+        break;
+      case FOP_OPEN:
+      case FOP_CLOSE:
+        /* tag is tracked by FOP_CHAR */
+        t.pc++;
+        stack.push_back(t);
+        break;
+      case FOP_REPEAT:
+      case FOP_COUNT: {
+        int alternate;
+        follow_counter(prog, inst, &t.pc, t.counts, &alternate);
+        if (alternate >= 0) {
+          struct fsm_thread exit = t;
+          exit.pc = alternate;
+          exit.counts[inst->tag] = 0;
+          stack.push_back(exit);
+        }
+        stack.push_back(t);
+        break;
+      }
+      case FOP_CHAR:
+      case FOP_MATCH:
+        threads.push_back(t);
+        break;
+    }
+  }
+}
+
+/**
+ * A thread that remembers where <tag>ged items matched
+ */
+struct fsm_capture_thread {
+  /** instruction to execute */
+  int pc;
+  /** lowest non-empty <tag>ged item so far */
+  struct fsm_capture capture;
+  /** open <tag>ged items and where they started */
+  std::vector<std::pair<int,int> > open;
+  /** repeats counted by each program counter */
+  std::vector<int> counts;
+};
+
+/**
+ * Follow thread through jumps, splits, counters and <tag>s, adding each
+ * reachable CHAR or MATCH instruction to threads in priority order.
+ * @param prog the program
+ * @param visited configurations already added
+ * @param threads the list to add to
+ * @param thread the thread to follow
+ * @param offset the current input offset
+ * @param stack empty scratch space for threads still to follow
+ */
+static void add_capture_thread(const struct fsm_program *prog, struct fsm_visited &visited, std::vector<struct fsm_capture_thread> &threads, const struct fsm_capture_thread &thread, int offset, std::vector<struct fsm_capture_thread> &stack)
+{
+  stack.push_back(thread);
+  while (!stack.empty()) {
+    struct fsm_capture_thread t = stack.back();
+    const struct fsm_inst *inst;
+    stack.pop_back();
+    if (!visit(prog, visited, t.pc, t.counts)) {
+      /* a higher priority thread already got here */
+      continue;
+    }
+    inst = &prog->insts[t.pc];
+    switch (inst->op) {
+      case FOP_JMP:
+        t.pc = inst->x;
+        stack.push_back(t);
+        break;
+      case FOP_SPLIT:
+        t.pc = inst->y;
+        stack.push_back(t);
+        t.pc = inst->x;
+        stack.push_back(t);
+        break;
+      case FOP_OPEN:
+        t.open.push_back(std::make_pair(inst->tag, offset));
+        t.pc++;
+        stack.push_back(t);
+        break;
+      case FOP_CLOSE: {
+        int start = t.open.back().second;
+        t.open.pop_back();
+        /* PCRE keeps the last repeat of an item */
+        if (offset > start && (!t.capture.tag || inst->tag <= t.capture.tag)) {
+          t.capture.tag = inst->tag;
+          t.capture.offset = start;
+          t.capture.length = offset - start;
+        }
+        t.pc++;
+        stack.push_back(t);
+        break;
+      }
+      case FOP_REPEAT:
+      case FOP_COUNT: {
+        int alternate;
+        follow_counter(prog, inst, &t.pc, t.counts, &alternate);
+        if (alternate >= 0) {
+          struct fsm_capture_thread exit = t;
+          exit.pc = alternate;
+          exit.counts[inst->tag] = 0;
+          stack.push_back(exit);
+        }
+        stack.push_back(t);
+        break;
+      }
+      case FOP_CHAR:
+      case FOP_MATCH:
+        threads.push_back(t);
+        break;
+    }
+  }
+}
+
+/**
+ * Program simulation fed input a piece at a time.  Only live threads
+ * are kept, so memory is bounded by the program whatever the input length.
+ */
+struct fsm_stream {
+  /** the program */
+  const struct fsm_program *prog;
+  /** live threads in priority order */
+  std::vector<struct fsm_capture_thread> threads;
+  /** threads after the next character, kept so stepping doesn't allocate */
+  std::vector<struct fsm_capture_thread> next;
+  /** threads still to follow while adding one */
+  std::vector<struct fsm_capture_thread> stack;
+  /** configurations already added */
+  struct fsm_visited visited;
+  /** input consumed so far */
+  int offset;
+  /** threads after the next character, kept to look ahead without copying the stream */
+  fsm_thread_list lookahead;
+  /** configurations already added to lookahead */
+  struct fsm_visited lookahead_visited;
+};
+
+/**
+ * Advance all threads by one input character
+ * @param stream the stream
+ * @param c the input character
+ */
+static void stream_step(struct fsm_stream *stream, unsigned char c)
+{
+  size_t i;
+  stream->next.clear();
+  visited_next(stream->visited);
+  for (i = 0; i < stream->threads.size(); i++) {
+    const struct fsm_inst *inst = &stream->prog->insts[stream->threads[i].pc];
+    if (inst->op == FOP_CHAR && inst->c == c) {
+      stream->threads[i].pc++;
+      add_capture_thread(stream->prog, stream->visited, stream->next, stream->threads[i], stream->offset + 1, stream->stack);
+    }
+  }
+  stream->threads.swap(stream->next);
+  stream->offset++;
+}
+
+/**
+ * Create a stream at the start of input
+ * @param prog the program, which must outlive the stream
+ * @return the stream
+ */
+struct fsm_stream *fsm_stream_create(const struct fsm_program *prog)
+{
+  struct fsm_stream *stream = new fsm_stream;
+  stream->prog = prog;
+  stream->visited.marks.resize(prog->insts.size(), 0);
+  stream->visited.mark = 0;
+  stream->lookahead_visited.marks.resize(prog->insts.size(), 0);
+  stream->lookahead_visited.mark = 0;
+  fsm_stream_reset(stream);
+  return stream;
+}
+
+/**
+ * Discard all input
+ * @param stream the stream
+ */
+void fsm_stream_reset(struct fsm_stream *stream)
+{
+  struct fsm_capture_thread start;
+  start.pc = 0;
+  start.capture.tag = 0;
+  start.capture.offset = 0;
+  start.capture.length = 0;
+  start.counts.resize(stream->prog->counters.size(), 0);
+  stream->threads.clear();
+  stream->offset = 0;
+  visited_next(stream->visited);
+  add_capture_thread(stream->prog, stream->visited, stream->threads, start, 0, stream->stack);
+}
+
+/**
+ * Consume more input.  Time is linear in the input length.
+ * @param stream the stream
+ * @param input the input
+ * @param len the input length
+ * @return true if the input so far can still match
+ */
+int fsm_stream_feed(struct fsm_stream *stream, const char *input, size_t len)
+{
+  size_t i;
+  for (i = 0; i < len && !stream->threads.empty(); i++) {
+    stream_step(stream, input[i]);
+  }
+  return !stream->threads.empty();
+}
+
+/**
+ * Check if the input so far matches
+ * @param stream the stream
+ * @param capture set to the interpretation of the input if it matches
+ * @return true if the input so far matches
+ */
+int fsm_stream_result(const struct fsm_stream *stream, struct fsm_capture *capture)
+{
+  size_t i;
+  for (i = 0; i < stream->threads.size(); i++) {
+    if (stream->prog->insts[stream->threads[i].pc].op == FOP_MATCH) {
+      *capture = stream->threads[i].capture;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @param stream the stream
+ * @param c the next input character
+ * @return true if the input so far can be followed by c
+ */
+int fsm_stream_can_step(const struct fsm_stream *stream, unsigned char c)
+{
+  size_t i;
+  for (i = 0; i < stream->threads.size(); i++) {
+    const struct fsm_inst *inst = &stream->prog->insts[stream->threads[i].pc];
+    if (inst->op == FOP_CHAR && inst->c == c) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Only the threads that can consume c are stepped, without tracking
+ * <tag>s, into scratch space kept by the stream.
+ * @param stream the stream
+ * @param c the next input character
+ * @return true if the input so far followed by c matches
+ */
+int fsm_stream_accepts_after(struct fsm_stream *stream, unsigned char c)
+{
+  size_t i, j;
+  stream->lookahead.clear();
+  visited_next(stream->lookahead_visited);
+  for (i = 0; i < stream->threads.size(); i++) {
+    const struct fsm_inst *inst = &stream->prog->insts[stream->threads[i].pc];
+    if (inst->op == FOP_CHAR && inst->c == c) {
+      struct fsm_thread thread;
+      thread.pc = stream->threads[i].pc + 1;
+      thread.tag = 0;
+      thread.counts = stream->threads[i].counts;
+      j = stream->lookahead.size();
+      add_thread(stream->prog, stream->lookahead_visited, stream->lookahead, thread);
+      for (; j < stream->lookahead.size(); j++) {
+        if (stream->prog->insts[stream->lookahead[j].pc].op == FOP_MATCH) {
+          return 1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Destroy the stream
+ * @param stream the stream
+ */
+void fsm_stream_destroy(struct fsm_stream *stream)
+{
+  delete stream;
+}
+
+/**
+ * Match input by simulating the program.  This is linear in the
+ * input and is used to find where the interpretation matched.
+ * @param prog the program
+ * @param input the input
+ * @param capture set to the interpretation of the input
+ * @return true if input matched
+ */
+int fsm_program_match(const struct fsm_program *prog, const char *input, struct fsm_capture *capture)
+{
+  struct fsm_stream stream;
+  stream.prog = prog;
+  stream.visited.marks.resize(prog->insts.size(), 0);
+  stream.visited.mark = 0;
+  /* no lookahead, so lookahead_visited has no marks */
+  stream.lookahead_visited.mark = 0;
+  fsm_stream_reset(&stream);
+  return fsm_stream_feed(&stream, input, strlen(input)) && fsm_stream_result(&stream, capture);
+}
+
+/**
+ * Find or create DFA state for thread list
+ * @return the state number
+ */
+static int intern_state(std::map<std::vector<int>,int> &ids, std::vector<fsm_thread_list> &states, const fsm_thread_list &threads)
+{
+  std::vector<int> key;
+  std::map<std::vector<int>,int>::iterator it;
+  size_t i;
+  for (i = 0; i < threads.size(); i++) {
+    key.push_back(threads[i].pc);
+    key.push_back(threads[i].tag);
+    key.insert(key.end(), threads[i].counts.begin(), threads[i].counts.end());
+  }
+  it = ids.find(key);
+  if (it != ids.end()) {
+    return it->second;
+  }
+  ids[key] = states.size();
+  states.push_back(threads);
+  return states.size() - 1;
+}
+
+/**
+ * Merge equivalent states using Moore's partition refinement
+ * @param num_states the number of states
+ * @param num_classes the number of input classes
+ * @param transitions the transition table
+ * @param accept the accepting states
+ * @param tag the accepting state tags
+ * @param part set to the minimized state of each state.  The dead state maps to FSM_DEAD_STATE.
+ * @return the number of minimized states
+ */
+static int minimize(int num_states, int num_classes, const std::vector<int> &transitions, const std::vector<char> &accept, const std::vector<int> &tag, std::vector<int> &part)
+{
+  std::map<std::pair<int,int>,int> initial;
+  std::vector<int> renumber;
+  int num_parts;
+  int next_id = 1;
+  int s;
+
+  /* start by splitting on output */
+  part.resize(num_states);
+  for (s = 0; s < num_states; s++) {
+    std::pair<int,int> output(accept[s], tag[s]);
+    if (!initial.count(output)) {
+      int id = initial.size();
+      initial[output] = id;
+    }
+    part[s] = initial[output];
+  }
+  num_parts = initial.size();
+
+  /* split until no partition disagrees on where its inputs go */
+  for (;;) {
+    std::map<std::vector<int>,int> signatures;
+    std::vector<int> next_part(num_states);
+    for (s = 0; s < num_states; s++) {
+      std::vector<int> signature;
+      int k;
+      signature.push_back(part[s]);
+      for (k = 1; k < num_classes; k++) {
+        signature.push_back(part[transitions[s * num_classes + k]]);
+      }
+      if (!signatures.count(signature)) {
+        int id = signatures.size();
+        signatures[signature] = id;
+      }
+      next_part[s] = signatures[signature];
+    }
+    if ((int)signatures.size() == num_parts) {
+      break;
+    }
+    num_parts = signatures.size();
+    part.swap(next_part);
+  }
+
+  /* state 0 is the dead state */
+  renumber.resize(num_parts, -1);
+  renumber[part[FSM_DEAD_STATE]] = FSM_DEAD_STATE;
+  for (s = 0; s < num_states; s++) {
+    if (renumber[part[s]] < 0) {
+      renumber[part[s]] = next_id++;
+    }
+    part[s] = renumber[part[s]];
+  }
+  return num_parts;
+}
+
+/**
+ * Compile program into a minimized DFA.  Threads are kept in
+ * priority order so each accepting state knows which <tag>
+ * a backtracking matcher would have reported.
+ * @param prog the program
+ * @param max_states give up if more states than this are needed
+ * @return the DFA or NULL if too big
+ */
+struct fsm_dfa *fsm_dfa_create(const struct fsm_program *prog, int max_states)
+{
+  struct fsm_dfa *dfa;
+  unsigned char classes[256] = { 0 };
+  std::vector<unsigned char> class_chars(1, '\0');
+  std::map<std::vector<int>,int> ids;
+  std::vector<fsm_thread_list> states;
+  struct fsm_visited visited;
+  struct fsm_thread thread;
+  std::vector<int> transitions;
+  std::vector<char> accept;
+  std::vector<int> tag;
+  std::vector<int> part;
+  fsm_thread_list threads;
+  int num_classes;
+  int num_states;
+  int start;
+  int s;
+  size_t i;
+
+  if (prog->insts.empty()) {
+    return NULL;
+  }
+
+  /* each character used by the program gets its own class, everything else is rejected */
+  for (i = 0; i < prog->insts.size(); i++) {
+    unsigned char c = prog->insts[i].c;
+    if (prog->insts[i].op == FOP_CHAR && !classes[c]) {
+      classes[c] = class_chars.size();
+      class_chars.push_back(c);
+    }
+  }
+  num_classes = class_chars.size();
+
+  /* subset construction */
+  visited.marks.resize(prog->insts.size(), 0);
+  visited.mark = 0;
+  thread.pc = 0;
+  thread.tag = 0;
+  thread.counts.resize(prog->counters.size(), 0);
+  intern_state(ids, states, threads);
+  visited_next(visited);
+  add_thread(prog, visited, threads, thread);
+  start = intern_state(ids, states, threads);
+  for (s = 0; s < (int)states.size(); s++) {
+    /* copy - states grows below */
+    const fsm_thread_list current = states[s];
+    int k;
+    for (k = 0; k < num_classes; k++) {
+      fsm_thread_list next;
+      if (k > 0) {
+        visited_next(visited);
+        for (i = 0; i < current.size(); i++) {
+          const struct fsm_inst *inst = &prog->insts[current[i].pc];
+          if (inst->op == FOP_CHAR && inst->c == class_chars[k]) {
+            thread = current[i];
+            thread.pc++;
+            thread.tag = fsm_tag_min(thread.tag, inst->tag);
+            add_thread(prog, visited, next, thread);
+          }
+        }
+      }
+      transitions.push_back(intern_state(ids, states, next));
+      if ((int)states.size() > max_states) {
+        return NULL;
+      }
+    }
+  }
+  num_states = states.size();
+
+  /* the first thread to reach MATCH is the one PCRE would have picked */
+  for (s = 0; s < num_states; s++) {
+    char accepts = 0;
+    int accept_tag = 0;
+    for (i = 0; i < states[s].size(); i++) {
+      if (prog->insts[states[s][i].pc].op == FOP_MATCH) {
+        accepts = 1;
+        accept_tag = states[s][i].tag;
+        break;
+      }
+    }
+    accept.push_back(accepts);
+    tag.push_back(accept_tag);
+  }
+
+  /* build minimized DFA */
+  dfa = (struct fsm_dfa *)malloc(sizeof(*dfa));
+  dfa->num_states = minimize(num_states, num_classes, transitions, accept, tag, part);
+  dfa->num_classes = num_classes;
+  memcpy(dfa->classes, classes, sizeof(classes));
+  dfa->start = part[start];
+  dfa->transitions = (int *)malloc(sizeof(int) * dfa->num_states * num_classes);
+  dfa->accept = (char *)malloc(sizeof(char) * dfa->num_states);
+  dfa->tag = (int *)malloc(sizeof(int) * dfa->num_states);
+  for (s = 0; s < num_states; s++) {
+    int k;
+    for (k = 0; k < num_classes; k++) {
+      dfa->transitions[part[s] * num_classes + k] = part[transitions[s * num_classes + k]];
+    }
+    dfa->accept[part[s]] = accept[s];
+    dfa->tag[part[s]] = tag[s];
+  }
+
+  /* precompute what may follow each state so nothing needs to be probed while matching */
+  dfa->next_symbols = (unsigned int *)malloc(sizeof(unsigned int) * dfa->num_states);
+  dfa->match_end = (char *)malloc(sizeof(char) * dfa->num_states);
+  for (s = 0; s < dfa->num_states; s++) {
+    const char *symbol = SRGS_DTMF_SYMBOLS;
+    dfa->next_symbols[s] = 0;
+    dfa->match_end[s] = 1;
+    for (i = 0; symbol[i]; i++) {
+      int next = fsm_dfa_step(dfa, s, symbol[i]);
+      if (next != FSM_DEAD_STATE) {
+        dfa->next_symbols[s] |= 1 << i;
+        if (dfa->accept[next]) {
+          dfa->match_end[s] = 0;
+        }
+      }
+    }
+  }
+  return dfa;
+}
+
+/**
+ * Run DFA over input
+ * @param dfa the DFA
+ * @param input the input
+ * @return the final state, FSM_DEAD_STATE if input was rejected
+ */
+int fsm_dfa_run(const struct fsm_dfa *dfa, const char *input)
+{
+  int state = dfa->start;
+  for (; *input && state != FSM_DEAD_STATE; input++) {
+    state = fsm_dfa_step(dfa, state, *input);
+  }
+  return state;
+}
+
+#ifdef FSM_HAVE_AVX2
+/**
+ * Run DFA over many inputs with AVX2 gathers from the transition table.
+ * The input classes are looked up once and packed with an end marker
+ * after each input.  Each of the FSM_LANES * FSM_VECTORS lanes runs one
+ * input at a time and takes the next input as soon as its input ends or
+ * is rejected, so no lane waits for the longest input.
+ * @param dfa the DFA
+ * @param inputs the inputs, NULL is the same as empty
+ * @param num_inputs the number of inputs
+ * @param states set to the final state of each input
+ * @return the number of inputs run
+ */
+__attribute__((target("avx2")))
+static int dfa_run_avx2(const struct fsm_dfa *dfa, const char **inputs, int num_inputs, int *states)
+{
+  const int lanes = FSM_LANES * FSM_VECTORS;
+  std::vector<int> classes;
+  int starts[FSM_CHUNK];
+  int offsets[FSM_LANES * FSM_VECTORS];
+  int lane_states[FSM_LANES * FSM_VECTORS];
+  int lane_inputs[FSM_LANES * FSM_VECTORS];
+  __m256i num_classes = _mm256_set1_epi32(dfa->num_classes);
+  __m256i end = _mm256_set1_epi32(-1);
+  __m256i dead = _mm256_set1_epi32(FSM_DEAD_STATE);
+  __m256i one = _mm256_set1_epi32(1);
+  int first;
+
+  for (first = 0; first < num_inputs; first += FSM_CHUNK) {
+    int count = num_inputs - first < FSM_CHUNK ? num_inputs - first : FSM_CHUNK;
+    int next_input = 0;
+    int running = 0;
+    int i;
+
+    /* idle lanes sit on the end marker at offset 0 */
+    classes.clear();
+    classes.push_back(-1);
+    for (i = 0; i < count; i++) {
+      const unsigned char *c = (const unsigned char *)(inputs[first + i] ? inputs[first + i] : "");
+      starts[i] = classes.size();
+      for (; *c; c++) {
+        classes.push_back(dfa->classes[*c]);
+      }
+      classes.push_back(-1);
+    }
+
+    for (i = 0; i < lanes; i++) {
+      if (next_input < count) {
+        offsets[i] = starts[next_input];
+        lane_inputs[i] = next_input++;
+        running++;
+      } else {
+        offsets[i] = 0;
+        lane_inputs[i] = -1;
+      }
+      lane_states[i] = dfa->start;
+    }
+
+    while (running) {
+      int done = 0;
+      int j;
+      for (j = 0; j < FSM_VECTORS; j++) {
+        __m256i offset = _mm256_loadu_si256((const __m256i *)&offsets[j * FSM_LANES]);
+        __m256i state = _mm256_loadu_si256((const __m256i *)&lane_states[j * FSM_LANES]);
+        __m256i k = _mm256_i32gather_epi32(&classes[0], offset, 4);
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi32(k, end), _mm256_cmpeq_epi32(state, dead));
+        __m256i step = _mm256_xor_si256(stop, end);
+        __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(state, num_classes), k);
+        /* lanes that stopped keep their state and offset */
+        state = _mm256_mask_i32gather_epi32(state, dfa->transitions, index, step, 4);
+        offset = _mm256_add_epi32(offset, _mm256_and_si256(step, one));
+        _mm256_storeu_si256((__m256i *)&offsets[j * FSM_LANES], offset);
+        _mm256_storeu_si256((__m256i *)&lane_states[j * FSM_LANES], state);
+        done |= _mm256_movemask_ps(_mm256_castsi256_ps(stop)) << (j * FSM_LANES);
+      }
+      /* hand finished lanes their next input */
+      while (done) {
+        int lane = __builtin_ctz(done);
+        done &= done - 1;
+        if (lane_inputs[lane] < 0) {
+          continue;
+        }
+        states[first + lane_inputs[lane]] = lane_states[lane];
+        if (next_input < count) {
+          offsets[lane] = starts[next_input];
+          lane_inputs[lane] = next_input++;
+        } else {
+          offsets[lane] = 0;
+          lane_inputs[lane] = -1;
+          running--;
+        }
+        lane_states[lane] = dfa->start;
+      }
+    }
+  }
+  return num_inputs;
+}
+#endif
+
+/**
+ * Run DFA over many inputs.  Vector instructions are used if the CPU
+ * has them and they are switched on.
+ * @param dfa the DFA
+ * @param inputs the inputs, NULL is the same as empty
+ * @param num_inputs the number of inputs
+ * @param states set to the final state of each input
+ */
+void fsm_dfa_run_many(const struct fsm_dfa *dfa, const char **inputs, int num_inputs, int *states)
+{
+  int i = 0;
+#ifdef FSM_HAVE_AVX2
+  if (fsm_simd && __builtin_cpu_supports("avx2")) {
+    i = dfa_run_avx2(dfa, inputs, num_inputs, states);
+  }
+#endif
+  for (; i < num_inputs; i++) {
+    states[i] = fsm_dfa_run(dfa, inputs[i] ? inputs[i] : "");
+  }
+}
+
+/**
+ * Switch vector instructions on or off
+ * @param enabled true to use vector instructions if the CPU has them
+ * @return true if vector instructions are now used
+ */
+int fsm_set_simd(int enabled)
+{
+  fsm_simd = enabled;
+#ifdef FSM_HAVE_AVX2
+  return enabled && __builtin_cpu_supports("avx2");
+#else
+  return 0;
+#endif
+}
+
+/**
+ * @param dfa the DFA
+ * @return the memory used by the DFA in bytes
+ */
+size_t fsm_dfa_size(const struct fsm_dfa *dfa)
+{
+  return sizeof(*dfa) + (size_t)dfa->num_states * (dfa->num_classes * sizeof(int) + sizeof(char) + sizeof(int) + sizeof(unsigned int) + sizeof(char));
+}
+
+/**
+ * Destroy DFA
+ * @param dfa the DFA
+ */
+void fsm_dfa_destroy(struct fsm_dfa *dfa)
+{
+  if (dfa) {
+    free(dfa->transitions);
+    free(dfa->accept);
+    free(dfa->tag);
+    free(dfa->next_symbols);
+    free(dfa->match_end);
+    free(dfa);
+  }
+}
+
+/**
+ * Add a position to a Glushkov automaton being built.  The first
+ * position added is the start and consumes nothing.
+ * @param positions the automaton
+ * @param c the character consumed at the position
+ * @return the position number
+ */
+int fsm_positions_add(struct fsm_positions *positions, unsigned char c)
+{
+  positions->chars.push_back(c);
+  positions->follow.push_back(std::vector<int>());
+  return positions->chars.size() - 1;
+}
+
+/**
+ * Build the bit-parallel tables of a Glushkov automaton
+ * @param positions the automaton
+ * @return the automaton or NULL if it has too many positions
+ */
+struct fsm_glushkov *fsm_glushkov_create(const struct fsm_positions *positions)
+{
+  struct fsm_glushkov *glushkov;
+  std::vector<uint64_t> follow;
+  int num_positions = positions->chars.size();
+  int num_words;
+  int chunk;
+  int p;
+  size_t i;
+
+  if (num_positions < 1 || num_positions > FSM_GLUSHKOV_MAX_POSITIONS) {
+    return NULL;
+  }
+  num_words = (num_positions + 63) / 64;
+
+  glushkov = (struct fsm_glushkov *)malloc(sizeof(*glushkov));
+  glushkov->num_positions = num_positions;
+  glushkov->num_words = num_words;
+  glushkov->num_chunks = (num_positions + 7) / 8;
+  glushkov->chars = (uint64_t *)calloc(256 * num_words, sizeof(uint64_t));
+  glushkov->follow = (uint64_t *)calloc(glushkov->num_chunks * 256 * num_words, sizeof(uint64_t));
+  memset(glushkov->accept, 0, sizeof(glushkov->accept));
+
+  /* position sets consuming each character and following each position */
+  follow.resize(glushkov->num_chunks * 8 * num_words);
+  for (p = 0; p < num_positions; p++) {
+    if (p) {
+      glushkov->chars[positions->chars[p] * num_words + p / 64] |= (uint64_t)1 << (p % 64);
+    }
+    for (i = 0; i < positions->follow[p].size(); i++) {
+      int next = positions->follow[p][i];
+      follow[p * num_words + next / 64] |= (uint64_t)1 << (next % 64);
+    }
+  }
+  for (i = 0; i < positions->accept.size(); i++) {
+    glushkov->accept[positions->accept[i] / 64] |= (uint64_t)1 << (positions->accept[i] % 64);
+  }
+
+  /* each byte value follows the positions of its lowest bit and of the rest of it */
+  for (chunk = 0; chunk < glushkov->num_chunks; chunk++) {
+    uint64_t *table = glushkov->follow + chunk * 256 * num_words;
+    int byte;
+    for (byte = 1; byte < 256; byte++) {
+      const uint64_t *rest = table + (byte & (byte - 1)) * num_words;
+      const uint64_t *lowest = &follow[(chunk * 8 + __builtin_ctz(byte)) * num_words];
+      int w;
+      for (w = 0; w < num_words; w++) {
+        table[byte * num_words + w] = rest[w] | lowest[w];
+      }
+    }
+  }
+  return glushkov;
+}
+
+/**
+ * Find the positions that can come next after a set
+ * @param glushkov the automaton
+ * @param set the active positions
+ * @param next set to the positions that follow them
+ */
+static inline void glushkov_follow(const struct fsm_glushkov *glushkov, const uint64_t *set, uint64_t *next)
+{
+  int num_words = glushkov->num_words;
+  int chunk;
+  int w;
+  for (w = 0; w < num_words; w++) {
+    next[w] = 0;
+  }
+  for (chunk = 0; chunk < glushkov->num_chunks; chunk++) {
+    unsigned int byte = (set[chunk / 8] >> (chunk % 8 * 8)) & 0xff;
+    if (byte) {
+      const uint64_t *follow = glushkov->follow + (chunk * 256 + byte) * num_words;
+      for (w = 0; w < num_words; w++) {
+        next[w] |= follow[w];
+      }
+    }
+  }
+}
+
+/**
+ * Set the active positions to the start.  Only the words the automaton
+ * uses are cleared, the rest of the set is never read.
+ * @param glushkov the automaton
+ * @param set the position set, FSM_GLUSHKOV_MAX_WORDS words
+ */
+void fsm_glushkov_start(const struct fsm_glushkov *glushkov, uint64_t *set)
+{
+  memset(set, 0, sizeof(uint64_t) * glushkov->num_words);
+  set[0] = 1;
+}
+
+/**
+ * Advance the active positions over input
+ * @param glushkov the automaton
+ * @param set the active positions, updated
+ * @param input the input
+ * @param len length of input
+ * @return true if any position is still active
+ */
+int fsm_glushkov_feed(const struct fsm_glushkov *glushkov, uint64_t *set, const char *input, size_t len)
+{
+  int num_words = glushkov->num_words;
+  uint64_t live = 0;
+  size_t i;
+  int w;
+  for (w = 0; w < num_words; w++) {
+    live |= set[w];
+  }
+  for (i = 0; i < len && live; i++) {
+    const uint64_t *chars = glushkov->chars + (unsigned char)input[i] * num_words;
+    uint64_t next[FSM_GLUSHKOV_MAX_WORDS];
+    glushkov_follow(glushkov, set, next);
+    live = 0;
+    for (w = 0; w < num_words; w++) {
+      set[w] = next[w] & chars[w];
+      live |= set[w];
+    }
+  }
+  return live != 0;
+}
+
+/**
+ * @param glushkov the automaton
+ * @param set the active positions
+ * @return true if input may end at one of the positions
+ */
+int fsm_glushkov_accepts(const struct fsm_glushkov *glushkov, const uint64_t *set)
+{
+  int w;
+  for (w = 0; w < glushkov->num_words; w++) {
+    if (set[w] & glushkov->accept[w]) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Find the DTMF symbols that can come next
+ * @param glushkov the automaton
+ * @param set the active positions
+ * @param match_end set to true if no DTMF symbol leads to a position input may end at
+ * @return bit i set if SRGS_DTMF_SYMBOLS[i] can follow
+ */
+unsigned int fsm_glushkov_next_symbols(const struct fsm_glushkov *glushkov, const uint64_t *set, int *match_end)
+{
+  int num_words = glushkov->num_words;
+  uint64_t next[FSM_GLUSHKOV_MAX_WORDS];
+  unsigned int symbols = 0;
+  int i;
+  glushkov_follow(glushkov, set, next);
+  *match_end = 1;
+  for (i = 0; SRGS_DTMF_SYMBOLS[i]; i++) {
+    const uint64_t *chars = glushkov->chars + (unsigned char)SRGS_DTMF_SYMBOLS[i] * num_words;
+    int w;
+    for (w = 0; w < num_words; w++) {
+      uint64_t positions = next[w] & chars[w];
+      if (positions) {
+        symbols |= 1 << i;
+      }
+      if (positions & glushkov->accept[w]) {
+        *match_end = 0;
+      }
+    }
+  }
+  return symbols;
+}
+
+/**
+ * @param glushkov the automaton
+ * @return the memory used by the automaton in bytes
+ */
+size_t fsm_glushkov_size(const struct fsm_glushkov *glushkov)
+{
+  return sizeof(*glushkov) + (256 + (size_t)glushkov->num_chunks * 256) * glushkov->num_words * sizeof(uint64_t);
+}
+
+/**
+ * Destroy Glushkov automaton
+ * @param glushkov the automaton
+ */
+void fsm_glushkov_destroy(struct fsm_glushkov *glushkov)
+{
+  if (glushkov) {
+    free(glushkov->chars);
+    free(glushkov->follow);
+    free(glushkov);
+  }
+}
+
+/**
+ * Find or create product state for a tuple of component states
+ * @return the state number
+ */
+static int intern_tuple(std::map<std::vector<int>,int> &ids, std::vector<std::vector<int> > &tuples, const std::vector<int> &tuple)
+{
+  std::map<std::vector<int>,int>::iterator it = ids.find(tuple);
+  if (it != ids.end()) {
+    return it->second;
+  }
+  ids[tuple] = tuples.size();
+  tuples.push_back(tuple);
+  return tuples.size() - 1;
+}
+
+/**
+ * Combine DFAs into one that steps them all with a single transition.
+ * Only tuples reachable from the start are created, and state 0 is the
+ * tuple where every component is dead.
+ * @param dfas the DFAs
+ * @param num_dfas the number of DFAs
+ * @param max_states give up if more states than this are needed
+ * @return the product DFA or NULL if too big
+ */
+struct fsm_product *fsm_product_create(struct fsm_dfa **dfas, int num_dfas, int max_states)
+{
+  struct fsm_product *product;
+  std::map<std::vector<int>,int> class_ids;
+  std::vector<unsigned char> class_chars;
+  std::map<std::vector<int>,int> ids;
+  std::vector<std::vector<int> > tuples;
+  std::vector<int> transitions;
+  std::vector<int> tuple(num_dfas, FSM_DEAD_STATE);
+  unsigned char classes[256];
+  int num_classes;
+  int start;
+  int s;
+  int c;
+  int i;
+
+  if (num_dfas < 1) {
+    return NULL;
+  }
+
+  /* characters are in the same class if every DFA puts them in the same class */
+  class_ids[tuple] = 0;
+  class_chars.push_back('\0');
+  for (c = 0; c < 256; c++) {
+    std::vector<int> signature(num_dfas);
+    for (i = 0; i < num_dfas; i++) {
+      signature[i] = dfas[i]->classes[c];
+    }
+    if (!class_ids.count(signature)) {
+      int id = class_ids.size();
+      class_ids[signature] = id;
+      class_chars.push_back(c);
+    }
+    classes[c] = class_ids[signature];
+  }
+  num_classes = class_chars.size();
+
+  intern_tuple(ids, tuples, tuple);
+  for (i = 0; i < num_dfas; i++) {
+    tuple[i] = dfas[i]->start;
+  }
+  start = intern_tuple(ids, tuples, tuple);
+  for (s = 0; s < (int)tuples.size(); s++) {
+    int k;
+    for (k = 0; k < num_classes; k++) {
+      for (i = 0; i < num_dfas; i++) {
+        tuple[i] = k ? fsm_dfa_step(dfas[i], tuples[s][i], class_chars[k]) : FSM_DEAD_STATE;
+      }
+      transitions.push_back(intern_tuple(ids, tuples, tuple));
+      if ((int)tuples.size() > max_states) {
+        return NULL;
+      }
+    }
+  }
+
+  product = (struct fsm_product *)malloc(sizeof(*product));
+  product->num_dfas = num_dfas;
+  product->num_states = tuples.size();
+  product->num_classes = num_classes;
+  memcpy(product->classes, classes, sizeof(classes));
+  product->start = start;
+  product->transitions = (int *)malloc(sizeof(int) * transitions.size());
+  memcpy(product->transitions, &transitions[0], sizeof(int) * transitions.size());
+  product->components = (int *)malloc(sizeof(int) * product->num_states * num_dfas);
+  for (s = 0; s < product->num_states; s++) {
+    for (i = 0; i < num_dfas; i++) {
+      product->components[s * num_dfas + i] = tuples[s][i];
+    }
+  }
+  return product;
+}
+
+/**
+ * Destroy product DFA
+ * @param product the product DFA
+ */
+void fsm_product_destroy(struct fsm_product *product)
+{
+  if (product) {
+    free(product->transitions);
+    free(product->components);
+    free(product);
+  }
+}
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 noet:
+ */
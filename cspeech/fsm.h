@@ -0,0 +1,257 @@
+/*
+ * cspeech - Speech document (SSML, SRGS, NLSML) modelling and matching for C
+ * Copyright (C) 2013, Grasshopper
+ *
+ * License: MIT
+ *
+ * Contributor(s):
+ * Chris Rienzo <chris.rienzo@grasshopper.com>
+ *
+ * fsm.h -- Finite state machines for matching SRGS
+ *
+ */
+#ifndef FSM_H
+#define FSM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+/** DFA state that rejects all input */
+#define FSM_DEAD_STATE 0
+
+/** most positions in a Glushkov automaton, including the start */
+#define FSM_GLUSHKOV_MAX_POSITIONS 256
+
+/** 64 bit words in a Glushkov position set */
+#define FSM_GLUSHKOV_MAX_WORDS (FSM_GLUSHKOV_MAX_POSITIONS / 64)
+
+/**
+ * Matcher program opcodes
+ */
+enum fsm_opcode {
+  /** consume one input character */
+  FOP_CHAR,
+  /** continue at x (preferred) or y */
+  FOP_SPLIT,
+  /** continue at x */
+  FOP_JMP,
+  /** accept if at end of input */
+  FOP_MATCH,
+  /** start of <tag>ged item */
+  FOP_OPEN,
+  /** end of <tag>ged item */
+  FOP_CLOSE,
+  /** continue at x to repeat an item again (preferred) or clear the counter and continue at y */
+  FOP_REPEAT,
+  /** count one repeat and continue at x */
+  FOP_COUNT
+};
+
+/**
+ * Matcher program instruction
+ */
+struct fsm_inst {
+  /** what to do */
+  enum fsm_opcode op;
+  /** FOP_CHAR character to consume */
+  unsigned char c;
+  /** FOP_CHAR lowest enclosing <tag> number, FOP_OPEN/FOP_CLOSE <tag> number, FOP_REPEAT/FOP_COUNT counter number */
+  int tag;
+  /** FOP_SPLIT/FOP_JMP/FOP_REPEAT/FOP_COUNT target */
+  int x;
+  /** FOP_SPLIT/FOP_REPEAT alternate target */
+  int y;
+};
+
+/**
+ * Bounds of a counted repeat
+ */
+struct fsm_counter {
+  /** minimum number of repeats */
+  int min;
+  /** maximum number of repeats, INT_MAX if unbounded */
+  int max;
+};
+
+/**
+ * A Thompson NFA.  Alternatives are ordered like PCRE
+ * so that both pick the same interpretation.
+ */
+struct fsm_program {
+  /** instructions, execution begins at 0 */
+  std::vector<struct fsm_inst> insts;
+  /** counted repeats, so wide repeat ranges are not copied */
+  std::vector<struct fsm_counter> counters;
+};
+
+/**
+ * Input matched by a <tag>ged item
+ */
+struct fsm_capture {
+  /** the <tag> number, 0 if none */
+  int tag;
+  /** offset of item in input */
+  int offset;
+  /** length of item in input */
+  int length;
+};
+
+/**
+ * Matcher program simulation fed input a piece at a time
+ */
+struct fsm_stream;
+
+/**
+ * A minimized DFA
+ */
+struct fsm_dfa {
+  /** number of states */
+  int num_states;
+  /** number of input classes - class 0 rejects */
+  int num_classes;
+  /** input character to class */
+  unsigned char classes[256];
+  /** initial state */
+  int start;
+  /** transition table, num_states x num_classes */
+  int *transitions;
+  /** true if state accepts */
+  char *accept;
+  /** interpretation <tag> number of accepting state, 0 if none */
+  int *tag;
+  /** bit i set if SRGS_DTMF_SYMBOLS[i] can follow state */
+  unsigned int *next_symbols;
+  /** true if no DTMF symbol leads from state to an accepting state */
+  char *match_end;
+};
+
+/**
+ * Glushkov position automaton being built.  Position 0 is the start,
+ * every other position consumes one input character.
+ */
+struct fsm_positions {
+  /** character consumed at each position */
+  std::vector<unsigned char> chars;
+  /** positions that can come next after each position */
+  std::vector<std::vector<int> > follow;
+  /** positions input may end at */
+  std::vector<int> accept;
+};
+
+/**
+ * Glushkov position automaton run bit-parallel.  The active positions
+ * are a bit set of num_words 64 bit words, position p is bit p % 64 of
+ * word p / 64.  Following a set ORs one precomputed set per byte of it.
+ */
+struct fsm_glushkov {
+  /** number of positions */
+  int num_positions;
+  /** number of 64 bit words in a position set */
+  int num_words;
+  /** number of bytes of a position set that can have positions */
+  int num_chunks;
+  /** positions consuming each input character, 256 x num_words */
+  uint64_t *chars;
+  /** positions following each byte value of each byte of a set, num_chunks x 256 x num_words */
+  uint64_t *follow;
+  /** positions input may end at */
+  uint64_t accept[FSM_GLUSHKOV_MAX_WORDS];
+};
+
+/**
+ * Several DFAs run in lockstep as one DFA.  Each state is a tuple
+ * of component DFA states.
+ */
+struct fsm_product {
+  /** number of component DFAs */
+  int num_dfas;
+  /** number of states */
+  int num_states;
+  /** number of input classes - class 0 rejects */
+  int num_classes;
+  /** input character to class */
+  unsigned char classes[256];
+  /** initial state */
+  int start;
+  /** transition table, num_states x num_classes */
+  int *transitions;
+  /** component DFA states, num_states x num_dfas */
+  int *components;
+};
+
+/**
+ * @return the lowest of two <tag> numbers where 0 means none
+ */
+static inline int fsm_tag_min(int a, int b)
+{
+  if (!a || (b && b < a)) {
+    return b;
+  }
+  return a;
+}
+
+/**
+ * Advance DFA by one input character
+ * @param dfa the DFA
+ * @param state the current state
+ * @param c the input character
+ * @return the next state
+ */
+static inline int fsm_dfa_step(const struct fsm_dfa *dfa, int state, unsigned char c)
+{
+  return dfa->transitions[state * dfa->num_classes + dfa->classes[c]];
+}
+
+extern int fsm_program_emit(struct fsm_program *prog, enum fsm_opcode op, unsigned char c, int tag, int x, int y);
+extern size_t fsm_program_size(const struct fsm_program *prog);
+extern int fsm_program_match(const struct fsm_program *prog, const char *input, struct fsm_capture *capture);
+extern struct fsm_stream *fsm_stream_create(const struct fsm_program *prog);
+extern void fsm_stream_reset(struct fsm_stream *stream);
+extern int fsm_stream_feed(struct fsm_stream *stream, const char *input, size_t len);
+extern int fsm_stream_result(const struct fsm_stream *stream, struct fsm_capture *capture);
+extern int fsm_stream_can_step(const struct fsm_stream *stream, unsigned char c);
+extern int fsm_stream_accepts_after(struct fsm_stream *stream, unsigned char c);
+extern void fsm_stream_destroy(struct fsm_stream *stream);
+extern struct fsm_dfa *fsm_dfa_create(const struct fsm_program *prog, int max_states);
+extern int fsm_dfa_run(const struct fsm_dfa *dfa, const char *input);
+extern void fsm_dfa_run_many(const struct fsm_dfa *dfa, const char **inputs, int num_inputs, int *states);
+extern int fsm_set_simd(int enabled);
+extern size_t fsm_dfa_size(const struct fsm_dfa *dfa);
+extern void fsm_dfa_destroy(struct fsm_dfa *dfa);
+
+/**
+ * Advance all component DFAs by one input character
+ * @param product the product DFA
+ * @param state the current state
+ * @param c the input character
+ * @return the next state
+ */
+static inline int fsm_product_step(const struct fsm_product *product, int state, unsigned char c)
+{
+  return product->transitions[state * product->num_classes + product->classes[c]];
+}
+
+extern int fsm_positions_add(struct fsm_positions *positions, unsigned char c);
+extern struct fsm_glushkov *fsm_glushkov_create(const struct fsm_positions *positions);
+extern void fsm_glushkov_start(const struct fsm_glushkov *glushkov, uint64_t *set);
+extern int fsm_glushkov_feed(const struct fsm_glushkov *glushkov, uint64_t *set, const char *input, size_t len);
+extern int fsm_glushkov_accepts(const struct fsm_glushkov *glushkov, const uint64_t *set);
+extern unsigned int fsm_glushkov_next_symbols(const struct fsm_glushkov *glushkov, const uint64_t *set, int *match_end);
+extern size_t fsm_glushkov_size(const struct fsm_glushkov *glushkov);
+extern void fsm_glushkov_destroy(struct fsm_glushkov *glushkov);
+extern struct fsm_product *fsm_product_create(struct fsm_dfa **dfas, int num_dfas, int max_states);
+extern void fsm_product_destroy(struct fsm_product *product);
+
+#endif
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 noet:
+ */
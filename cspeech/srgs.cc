@@ -13,16 +13,36 @@
 
 #include <iksemel.h>
 #include <pcre.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stdint.h>
+#include <deque>
 #include <sstream>
+#include <string>
 #include <map>
+#include <set>
+#include <vector>
 
 #include "cspeech.h"
 #include "srgs.h"
+#include "srgs_internal.h"
+#include "fsm.h"
 
 #define MAX_RECURSION 100
-#define MAX_TAGS 30
+#define MAX_REGEX_TAGS 30
+#define INITIAL_TAGS 16
+#define MAX_DFA_STATES 10000
+#define MAX_DFA_TRANSITIONS (MAX_DFA_STATES * 64)
+#define MAX_PROGRAM_SIZE 100000
+#define DEFAULT_CACHE_MAX_ENTRIES 1000
+#define DEFAULT_CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define FINGERPRINT_SIZE 32
+#define CACHE_SHARDS 16
+/** grammar->resident bit set while the grammar counts towards the cache size */
+#define GRAMMAR_CACHED ((size_t)1 << (sizeof(size_t) * 8 - 1))
+#define JIT_STACK_START_SIZE (32 * 1024)
+#define JIT_STACK_MAX_SIZE (512 * 1024)
 
 /** function to handle tag attributes */
 typedef int (* tag_attribs_fn)(struct srgs_grammar *, char **);
@@ -51,6 +71,16 @@ static struct {
   switch_memory_pool_t *pool;
   /** Callback for logging messages **/
   int (*logging_callback)(void *context, cspeech_log_level_t log_level, const char *log_message, ...);
+  /** true if new grammars call shared rules as regex subroutines */
+  bool regex_subroutines;
+  /** true if new grammars factor common prefixes out of <one-of> regexes */
+  bool regex_prefix_factoring;
+  /** true if PCRE supports JIT */
+  bool jit_available;
+  /** true if JIT code is used for matching */
+  bool jit;
+  /** per-thread JIT stack */
+  pthread_key_t jit_stack_key;
 } globals;
 
 /**
@@ -92,10 +122,26 @@ enum srgs_node_type {
  */
 struct rule_value {
   char is_public;
+  /** rule_tags of rule and the rules it references */
+  char tags;
+  /** regex subroutine number, 0 if not called yet, -1 if always inlined */
+  int subroutine;
   const char *id;
   char *regex;
 };
 
+/**
+ * Whether a rule contains <tag>s
+ */
+enum rule_tags {
+  /** not checked yet */
+  RT_UNKNOWN,
+  /** no <tag> in rule or the rules it references */
+  RT_NONE,
+  /** rule or a rule it references has a <tag> */
+  RT_SOME
+};
+
 /**
  * <item> value
  */
@@ -114,6 +160,18 @@ union ref_value {
   char *uri;
 };
 
+/**
+ * resolve_refs() progress of a node
+ */
+enum resolve_state {
+  /** not reached yet */
+  RS_UNVISITED,
+  /** node or its references are being resolved - reaching it again is a loop */
+  RS_RESOLVING,
+  /** node and everything it references is resolved and loop free */
+  RS_RESOLVED
+};
+
 /**
  * A node in the SRGS parse tree
  */
@@ -122,8 +180,10 @@ struct srgs_node {
   const char *name;
   /** Type of node */
   enum srgs_node_type type;
-  /** True if node has been inspected for loops */
-  char visited;
+  /** resolve_refs() progress */
+  char resolve_state;
+  /** number of child nodes */
+  int num_children;
   /** Node value */
   union {
     char *root;
@@ -134,12 +194,12 @@ struct srgs_node {
   } value;
   /** parent node */
   struct srgs_node *parent;
-  /** child node */
+  /** first child node */
   struct srgs_node *child;
+  /** last child node, for appending */
+  struct srgs_node *last_child;
   /** sibling node */
   struct srgs_node *next;
-  /** number of child nodes */
-  int num_children;
   /** tag handling data */
   struct tag_def *tag_def;
 };
@@ -154,10 +214,12 @@ struct srgs_grammar {
   struct srgs_node *cur;
   /** rule names mapped to node */
   std::map<const char *,struct srgs_node *> rules;
-  /** possible matching tags */
-  const char *tags[MAX_TAGS + 1];
+  /** possible matching tags, indexed by tag number starting at 1 */
+  const char **tags;
   /** number of tags */
   int tag_count;
+  /** number of tags that fit in tags without growing it */
+  int tag_capacity;
   /** grammar encoding */
   char *encoding;
   /** grammar language */
@@ -170,32 +232,255 @@ struct srgs_grammar {
   struct srgs_node *root_rule;
   /** compiled grammar regex */
   pcre *compiled_regex;
+  /** study data of compiled regex, NULL if none */
+  pcre_extra *extra;
+  /** regex capture number to <tag> number, 0 if capture is not a <tag> */
+  int *capture_tags;
+  /** requested matching engine */
+  enum srgs_match_engine engine;
+  /** engine picked if SME_AUTO is requested */
+  enum srgs_match_engine selected_engine;
+  /** grammar matcher program */
+  struct fsm_program *program;
+  /** compiled grammar DFA */
+  struct fsm_dfa *dfa;
+  /** bit-parallel Glushkov automaton, NULL if the grammar has too many positions */
+  struct fsm_glushkov *glushkov;
+  /** grammar_artifact bits of everything built so far */
+  int published;
+  /** true if rules without <tag>s are regex subroutines instead of inlined */
+  int regex_subroutines;
+  /** number of regex subroutines */
+  int subroutine_count;
+  /** true if runs of fixed string alternatives are written as a prefix trie */
+  int regex_prefix_factoring;
   /** grammar in regex format */
   char *regex;
   /** grammar in JSGF format */
   char *jsgf;
+  /** rules for repeated <item>s while JSGF is created */
+  switch_stream_handle_t *jsgf_repeats;
+  /** number of rules for repeated <item>s */
+  int jsgf_repeat_count;
   /** grammar as JSGF file */
   char *jsgf_file_name;
   /** synchronizes access to this grammar */
   switch_mutex_t *mutex;
   /** optional uuid for logging */
   const char *uuid;
+  /** references held by the parser cache and callers */
+  int refs;
+  /** true if the grammar is matched with its program until optimized matchers are built in the background */
+  int tiered;
+  /** estimated memory used by the grammar and its artifacts, GRAMMAR_CACHED if counted by the cache */
+  size_t resident;
+};
+
+/**
+ * Things built from a grammar on first use.  Once built they are never
+ * changed, so they are read without holding the grammar mutex.
+ */
+enum grammar_artifact {
+  /** grammar->regex */
+  GA_REGEX = 1 << 0,
+  /** grammar->compiled_regex, grammar->extra and grammar->capture_tags */
+  GA_COMPILED_REGEX = 1 << 1,
+  /** grammar->dfa */
+  GA_DFA = 1 << 2,
+  /** grammar->jsgf */
+  GA_JSGF = 1 << 3,
+  /** grammar->jsgf_file_name */
+  GA_JSGF_FILE = 1 << 4,
+  /** grammar->program */
+  GA_PROGRAM = 1 << 5,
+  /** the background upgrade of a tiered grammar is done */
+  GA_UPGRADED = 1 << 6,
+  /** grammar->selected_engine */
+  GA_ENGINE = 1 << 7,
+  /** grammar->glushkov */
+  GA_GLUSHKOV = 1 << 8
 };
 
+/** artifacts needed to match, regex and JSGF without locking */
+#define GA_FROZEN (GA_REGEX | GA_COMPILED_REGEX | GA_PROGRAM | GA_DFA | GA_GLUSHKOV | GA_JSGF)
+
+/**
+ * Library and parser options that change what is built from a grammar.
+ * They are part of the cache key, so a document parsed with other
+ * options is a different grammar.
+ */
+enum grammar_option {
+  /** grammar->regex_subroutines */
+  GO_REGEX_SUBROUTINES = 1 << 0,
+  /** grammar->regex_prefix_factoring */
+  GO_REGEX_PREFIX_FACTORING = 1 << 1,
+  /** grammar->tiered */
+  GO_TIERED_COMPILE = 1 << 2
+};
+
+/**
+ * @param grammar the grammar
+ * @param artifacts the grammar_artifact bits to check
+ * @return true if all artifacts have been built
+ */
+static inline int is_published(struct srgs_grammar *grammar, int artifacts)
+{
+  return (__atomic_load_n(&grammar->published, __ATOMIC_ACQUIRE) & artifacts) == artifacts;
+}
+
+/**
+ * Make an artifact built while holding the grammar mutex visible to readers
+ * @param grammar the grammar
+ * @param artifact the grammar_artifact bit
+ */
+static inline void publish(struct srgs_grammar *grammar, int artifact)
+{
+  __atomic_fetch_or(&grammar->published, artifact, __ATOMIC_RELEASE);
+}
+
+/**
+ * @param grammar the grammar
+ * @return true if the optimized matchers of a tiered grammar are still being built
+ */
+static inline int is_upgrading(struct srgs_grammar *grammar)
+{
+  return grammar->tiered && !is_published(grammar, GA_UPGRADED);
+}
+
 /**
  * The SRGS SAX parser
  */
 struct srgs_parser {
   /** parser memory pool */
   switch_memory_pool_t *pool;
-  /** grammar cache */
-  switch_hash_t *cache;
-  /** cache mutex */
-  switch_mutex_t *mutex;
   /** optional uuid for logging */
   const char *uuid;
+  /** true if grammars are compiled by srgs_parse() instead of the first match */
+  int eager_compile;
+  /** true if grammars are compiled in the background and matched with their program until then */
+  int tiered_compile;
+  /** grammars returned by srgs_parse(), the parser holds a reference to each */
+  std::set<struct srgs_grammar *> *grammars;
+  /** protects grammars */
+  switch_mutex_t *mutex;
+};
+
+/**
+ * @param parser the parser
+ * @return the grammar_option bits new grammars are built with
+ */
+static int grammar_options(struct srgs_parser *parser)
+{
+  int options = 0;
+  if (globals.regex_subroutines) {
+    options |= GO_REGEX_SUBROUTINES;
+  }
+  if (globals.regex_prefix_factoring) {
+    options |= GO_REGEX_PREFIX_FACTORING;
+  }
+  if (parser->tiered_compile && !parser->eager_compile) {
+    options |= GO_TIERED_COMPILE;
+  }
+  return options;
+}
+
+/**
+ * Grammar cache entry states
+ */
+enum grammar_cache_state {
+  /** document is being parsed */
+  GCS_PARSING,
+  /** document parsed */
+  GCS_PARSED,
+  /** document failed to parse and has been removed from the cache */
+  GCS_FAILED,
+  /** grammar has been evicted from the cache */
+  GCS_EVICTED
+};
+
+/**
+ * A cached grammar.  The entry is added before the document is parsed
+ * so that other callers wait for that parse instead of repeating it.
+ */
+struct grammar_cache_entry {
+  /** document fingerprint */
+  char key[FINGERPRINT_SIZE + 1];
+  /** normalized document, compared on lookup in case fingerprints collide */
+  char *document;
+  /** grammar_option bits the grammar was built with */
+  int options;
+  /** the parsed grammar, NULL until parsed */
+  struct srgs_grammar *grammar;
+  /** parse state */
+  enum grammar_cache_state state;
+  /** callers waiting for the parse */
+  int waiters;
+  /** cache.clock when the entry was last used */
+  unsigned long used;
+  /** more recently used entry */
+  struct grammar_cache_entry *prev;
+  /** less recently used entry */
+  struct grammar_cache_entry *next;
+};
+
+/**
+ * A part of the grammar cache with its own lock
+ */
+struct grammar_cache_shard {
+  /** document fingerprint to grammar_cache_entry */
+  switch_hash_t *entries;
+  /** shard mutex - never held while parsing */
+  switch_mutex_t *mutex;
+  /** signaled when a parse finishes */
+  switch_thread_cond_t *parsed;
+  /** most recently used parsed entry */
+  struct grammar_cache_entry *lru_head;
+  /** least recently used parsed entry */
+  struct grammar_cache_entry *lru_tail;
+  /** shard hits, misses and evictions */
+  struct srgs_cache_stats stats;
 };
 
+/**
+ * Process-wide grammar cache shared by all parsers.  Documents are
+ * spread over shards by fingerprint so that lookups of different
+ * grammars rarely contend for the same lock.
+ */
+static struct {
+  /** the shards */
+  struct grammar_cache_shard shards[CACHE_SHARDS];
+  /** maximum number of cached grammars, 0 for no limit */
+  unsigned long max_entries;
+  /** maximum size of cached grammars, 0 for no limit */
+  size_t max_bytes;
+  /** grammars in all shards */
+  unsigned long entries;
+  /** estimated size of grammars in all shards */
+  size_t resident_bytes;
+  /** counts entry uses to order entries of all shards by last use */
+  unsigned long clock;
+} cache;
+
+/**
+ * Tiered grammars waiting for their optimized matchers
+ */
+static struct {
+  /** protects the queue */
+  switch_mutex_t *mutex;
+  /** signaled when a grammar is queued */
+  switch_thread_cond_t *queued;
+  /** queued grammars, each holding a reference */
+  std::deque<struct srgs_grammar *> grammars;
+  /** the worker thread */
+  pthread_t thread;
+  /** true once the worker thread is running */
+  bool started;
+  /** true while queued grammars are left waiting */
+  bool paused;
+  /** true once srgs_shutdown() has stopped the worker */
+  bool stopped;
+} upgrades;
+
 /**
  * Convert entity name to node type
  * @param name of entity
@@ -320,28 +605,41 @@ static void sn_log_node_close(struct srgs_node *node)
 
 /**
  * Create a new node
+ * @param pool to use
  * @param name of node
  * @param type of node
  * @return the node
  */
-static struct srgs_node *sn_new(const char *name, enum srgs_node_type type)
+static struct srgs_node *sn_new(switch_memory_pool_t *pool, const char *name, enum srgs_node_type type)
 {
-  struct srgs_node *node = (struct srgs_node *) malloc(sizeof(srgs_node));
-  node->name = strdup(name);
+  struct srgs_node *node = (struct srgs_node *)switch_core_alloc(pool, sizeof(srgs_node));
+  node->name = switch_core_strdup(pool, name);
   node->type = type;
   return node;
 }
 
 /**
- * @param node to search
- * @return the last sibling of node
+ * Estimate the memory used by a node, its children and its following siblings
+ * @param node the first node
+ * @return the size in bytes
  */
-static struct srgs_node *sn_find_last_sibling(struct srgs_node *node)
+static size_t sn_size(struct srgs_node *node)
 {
-  if (node && node->next) {
-    return sn_find_last_sibling(node->next);
+  size_t size = 0;
+  for (; node; node = node->next) {
+    size += sizeof(*node) + strlen(node->name) + 1 + sn_size(node->child);
+    switch (node->type) {
+      case SNT_RULE:
+        size += strlen(node->value.rule.id) + 1;
+        break;
+      case SNT_STRING:
+        size += strlen(node->value.string) + 1;
+        break;
+      default:
+        break;
+    }
   }
-  return node;
+  return size;
 }
 
 /**
@@ -354,16 +652,16 @@ static struct srgs_node *sn_find_last_sibling(struct srgs_node *node)
  */
 static struct srgs_node *sn_insert(switch_memory_pool_t *pool, struct srgs_node *parent, const char *name, enum srgs_node_type type)
 {
-  struct srgs_node *sibling = parent ? sn_find_last_sibling(parent->child) : NULL;
-  struct srgs_node *child = sn_new(name, type);
+  struct srgs_node *child = sn_new(pool, name, type);
   if (parent) {
     parent->num_children++;
     child->parent = parent;
-  }
-  if (sibling) {
-    sibling->next = child;
-  } else if (parent) {
-    parent->child = child;
+    if (parent->last_child) {
+      parent->last_child->next = child;
+    } else {
+      parent->child = child;
+    }
+    parent->last_child = child;
   }
   return child;
 }
@@ -372,13 +670,13 @@ static struct srgs_node *sn_insert(switch_memory_pool_t *pool, struct srgs_node
  * Add string child node
  * @param pool to use
  * @param parent node to add string to
- * @param string to add - this function does not copy the string
+ * @param string to add - copied to pool
  * @return the string child node
  */
-static struct srgs_node *sn_insert_string(switch_memory_pool_t *pool, struct srgs_node *parent, char *string)
+static struct srgs_node *sn_insert_string(switch_memory_pool_t *pool, struct srgs_node *parent, const char *string)
 {
   struct srgs_node *child = sn_insert(pool, parent, string, SNT_STRING);
-  child->value.string = string;
+  child->value.string = child->name;
   return child;
 }
 
@@ -521,7 +819,7 @@ static int process_rule(struct srgs_grammar *grammar, char **atts)
         rule->value.rule.is_public = !cspeech_zstr(atts[i + 1]) && !strcmp("public", atts[i + 1]);
       } else if (!strcmp("id", atts[i])) {
         if (!cspeech_zstr(atts[i + 1])) {
-          rule->value.rule.id = strdup(atts[i + 1]);
+          rule->value.rule.id = switch_core_strdup(grammar->pool, atts[i + 1]);
         }
       }
       i += 2;
@@ -573,7 +871,7 @@ static int process_ruleref(struct srgs_grammar *grammar, char **atts)
           }
           return IKS_BADXML;
         }
-        ruleref->value.ref.uri = strdup(uri);
+        ruleref->value.ref.uri = switch_core_strdup(grammar->pool, uri);
         return IKS_OK;
       }
       i += 2;
@@ -619,7 +917,7 @@ static int process_item(struct srgs_grammar *grammar, char **atts)
           item->value.item.repeat_max = repeat_val;
         } else {
           /* range */
-          char *min = strdup(repeat);
+          char *min = switch_core_strdup(grammar->pool, repeat);
           char *max = strchr(min, '-');
           if (max) {
             *max = '\0';
@@ -658,7 +956,7 @@ static int process_item(struct srgs_grammar *grammar, char **atts)
           }
           return IKS_BADXML;
         }
-        item->value.item.weight = strdup(weight);
+        item->value.item.weight = switch_core_strdup(grammar->pool, weight);
       }
       i += 2;
     }
@@ -701,7 +999,7 @@ static int process_grammar(struct srgs_grammar *grammar, char **atts)
           }
           return IKS_BADXML;
         }
-        grammar->encoding = strdup(encoding);
+        grammar->encoding = switch_core_strdup(grammar->pool, encoding);
       } else if (!strcmp("language", atts[i])) {
         char *language = atts[i + 1];
         if (cspeech_zstr(language)) {
@@ -710,7 +1008,7 @@ static int process_grammar(struct srgs_grammar *grammar, char **atts)
           }
           return IKS_BADXML;
         }
-        grammar->language = strdup(language);
+        grammar->language = switch_core_strdup(grammar->pool, language);
       } else if (!strcmp("root", atts[i])) {
         char *root = atts[i + 1];
         if (cspeech_zstr(root)) {
@@ -719,7 +1017,7 @@ static int process_grammar(struct srgs_grammar *grammar, char **atts)
           }
           return IKS_BADXML;
         }
-        grammar->cur->value.root = strdup(root);
+        grammar->cur->value.root = switch_core_strdup(grammar->pool, root);
       }
       i += 2;
     }
@@ -737,7 +1035,7 @@ static int tag_hook(void *user_data, char *name, char **atts, int type)
 
   if (type == IKS_OPEN || type == IKS_SINGLE) {
     enum srgs_node_type ntype = string_to_node_type(name);
-    grammar->cur = sn_insert(grammar->cur, name, ntype);
+    grammar->cur = sn_insert(grammar->pool, grammar->cur, name, ntype);
     grammar->cur->tag_def = globals.tag_defs[name];
     if (!grammar->cur->tag_def) {
       grammar->cur->tag_def = globals.tag_defs["ANY"];
@@ -754,6 +1052,28 @@ static int tag_hook(void *user_data, char *name, char **atts, int type)
   return result;
 }
 
+/**
+ * Add a <tag> to the grammar.  The tag table doubles when full, so
+ * any number of <tag>s is allowed.
+ * @param grammar the grammar
+ * @param tag the <tag> content
+ * @return the unique tag number
+ */
+static int add_tag(struct srgs_grammar *grammar, const char *tag)
+{
+  if (grammar->tag_count + 1 >= grammar->tag_capacity) {
+    int capacity = grammar->tag_capacity ? grammar->tag_capacity * 2 : INITIAL_TAGS;
+    const char **tags = (const char **)switch_core_alloc(grammar->pool, capacity * sizeof(const char *));
+    if (grammar->tags) {
+      memcpy(tags, grammar->tags, (grammar->tag_count + 1) * sizeof(const char *));
+    }
+    grammar->tags = tags;
+    grammar->tag_capacity = capacity;
+  }
+  grammar->tags[++grammar->tag_count] = tag;
+  return grammar->tag_count;
+}
+
 /**
  * Process <tag> CDATA
  * @param grammar the grammar
@@ -765,19 +1085,10 @@ static int process_cdata_tag(struct srgs_grammar *grammar, char *data, size_t le
 {
   struct srgs_node *item = grammar->cur->parent;
   if (item && item->type == SNT_ITEM) {
-    if (grammar->tag_count < MAX_TAGS) {
-      /* grammar gets the tag name, item gets the unique tag number */
-      char *tag = (char *)malloc(sizeof(char) * (len + 1));
-      tag[len] = '\0';
-      strncpy(tag, data, len);
-      grammar->tags[++grammar->tag_count] = tag;
-      item->value.item.tag = grammar->tag_count;
-    } else {
-      if(globals.logging_callback) {
-        globals.logging_callback(NULL, CSPEECH_LOG_WARNING, "too many <tag>s\n");
-      }
-      return IKS_BADXML;
-    }
+    /* grammar gets the tag name, item gets the unique tag number */
+    char *tag = (char *)switch_core_alloc(grammar->pool, len + 1);
+    memcpy(tag, data, len);
+    item->value.item.tag = add_tag(grammar, tag);
   }
   return IKS_OK;
 }
@@ -796,18 +1107,17 @@ static int process_cdata_tokens(struct srgs_grammar *grammar, char *data, size_t
   if (grammar->digit_mode) {
     for (i = 0; i < len; i++) {
       if (isdigit(data[i]) || data[i] == '#' || data[i] == '*') {
-        char *digit = (char *)malloc(sizeof(char) * 2);
-        digit[0] = data[i];
-        digit[1] = '\0';
-        string = sn_insert_string(string, digit);
+        char digit[2] = { data[i], '\0' };
+        string = sn_insert_string(grammar->pool, string, digit);
         sn_log_node_open(string);
       }
     }
   } else {
-    char *data_dup = (char *)malloc(sizeof(char) * (len + 1));
+    char *data_dup = (char *)switch_core_alloc(grammar->pool, len + 1);
     char *start = data_dup;
     char *end = start + len - 1;
     memcpy(data_dup, data, len);
+    data_dup[len] = '\0';
     /* remove start whitespace */
     for (; start && *start && !isgraph(*start); start++) {
     }
@@ -817,7 +1127,7 @@ static int process_cdata_tokens(struct srgs_grammar *grammar, char *data, size_t
         *end = '\0';
       }
       if (!cspeech_zstr(start)) {
-        string = sn_insert_string(string, start);
+        string = sn_insert_string(grammar->pool, string, start);
       }
     }
   }
@@ -855,33 +1165,400 @@ static int cdata_hook(void *user_data, char *data, size_t len)
 /**
  * Create a new parsed grammar
  * @param parser
+ * @param options grammar_option bits to build the grammar with
  * @return the grammar
  */
-struct srgs_grammar *srgs_grammar_new(struct srgs_parser *parser)
+struct srgs_grammar *srgs_grammar_new(struct srgs_parser *parser, int options)
 {
   switch_memory_pool_t *pool = NULL;
   struct srgs_grammar *grammar = NULL;
   switch_core_new_memory_pool(&pool);
   grammar = switch_core_alloc(pool, sizeof (*grammar));
+  grammar->pool = pool;
+  grammar->refs = 1;
   grammar->root = NULL;
   grammar->cur = NULL;
   grammar->uuid = (parser && !cspeech_zstr(parser->uuid)) ? switch_core_strdup(pool, parser->uuid) : "";
+  grammar->engine = SME_AUTO;
+  grammar->regex_subroutines = !!(options & GO_REGEX_SUBROUTINES);
+  grammar->regex_prefix_factoring = !!(options & GO_REGEX_PREFIX_FACTORING);
   switch_mutex_init(&grammar->mutex, SWITCH_MUTEX_NESTED, pool);
   return grammar;
 }
 
 /**
- * Destroy a parsed grammar
+ * Destroy a parsed grammar.  The parse tree, tags and generated regex
+ * and JSGF are allocated from the grammar's pool and go with it.
  * @param grammar the grammar
  */
 static void srgs_grammar_destroy(struct srgs_grammar *grammar)
 {
+  switch_memory_pool_t *pool = grammar->pool;
+
+  if (grammar->extra) {
+#ifdef PCRE_STUDY_JIT_COMPILE
+    pcre_free_study(grammar->extra);
+#else
+    pcre_free(grammar->extra);
+#endif
+  }
   if (grammar->compiled_regex) {
     pcre_free(grammar->compiled_regex);
   }
+  delete grammar->program;
+  fsm_dfa_destroy(grammar->dfa);
+  fsm_glushkov_destroy(grammar->glushkov);
   if (grammar->jsgf_file_name) {
-    switch_file_remove(grammar->jsgf_file_name, pool);
+    switch_file_remove(grammar->jsgf_file_name, grammar->pool);
+  }
+  grammar->rules.clear();
+  switch_core_destroy_memory_pool(&pool);
+}
+
+/**
+ * Count memory used by a grammar, and by the cache if the grammar is in it
+ * @param grammar the grammar
+ * @param size bytes to add
+ */
+static void grammar_add_size(struct srgs_grammar *grammar, size_t size)
+{
+  if (__atomic_fetch_add(&grammar->resident, size, __ATOMIC_RELAXED) & GRAMMAR_CACHED) {
+    __atomic_add_fetch(&cache.resident_bytes, size, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Start counting a grammar and the artifacts built for it in the cache size
+ * @param grammar the grammar
+ */
+static void cache_add_size(struct srgs_grammar *grammar)
+{
+  size_t resident = __atomic_fetch_or(&grammar->resident, GRAMMAR_CACHED, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&cache.resident_bytes, resident & ~GRAMMAR_CACHED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Stop counting a grammar in the cache size
+ * @param grammar the grammar
+ */
+static void cache_remove_size(struct srgs_grammar *grammar)
+{
+  size_t resident = __atomic_fetch_and(&grammar->resident, ~GRAMMAR_CACHED, __ATOMIC_RELAXED);
+  __atomic_sub_fetch(&cache.resident_bytes, resident & ~GRAMMAR_CACHED, __ATOMIC_RELAXED);
+}
+
+/**
+ * Estimate the memory used by a parsed grammar.  Matchers are counted
+ * with grammar_add_size() as they are built.
+ * @param grammar the grammar
+ * @param document_size length of the document kept by the cache
+ * @return the size in bytes
+ */
+static size_t srgs_grammar_size(struct srgs_grammar *grammar, size_t document_size)
+{
+  size_t size = sizeof(*grammar) + document_size + sn_size(grammar->root);
+  int i;
+  for (i = 1; i <= grammar->tag_count; i++) {
+    size += strlen(grammar->tags[i]) + 1;
+  }
+  return size;
+}
+
+/**
+ * Take a reference to a grammar so that it stays valid after it is
+ * evicted from the parser cache or the parser is destroyed.
+ * @param grammar the grammar
+ * @return the grammar
+ */
+struct srgs_grammar *srgs_grammar_ref(struct srgs_grammar *grammar)
+{
+  if (grammar) {
+    __atomic_add_fetch(&grammar->refs, 1, __ATOMIC_RELAXED);
+  }
+  return grammar;
+}
+
+/**
+ * Release a reference to a grammar.  The grammar is destroyed when
+ * the last reference is released.
+ * @param grammar the grammar
+ */
+void srgs_grammar_unref(struct srgs_grammar *grammar)
+{
+  if (grammar && !__atomic_sub_fetch(&grammar->refs, 1, __ATOMIC_ACQ_REL)) {
+    srgs_grammar_destroy(grammar);
+  }
+}
+
+/**
+ * 128-bit document fingerprint made of two independent 64-bit hashes
+ */
+struct fingerprint {
+  /** FNV-1a hash */
+  uint64_t a;
+  /** multiplicative hash */
+  uint64_t b;
+};
+
+/**
+ * Add a character to a fingerprint
+ * @param fp the fingerprint
+ * @param c the character
+ */
+static inline void fingerprint_add(struct fingerprint *fp, unsigned char c)
+{
+  fp->a = (fp->a ^ c) * 0x100000001b3ULL;
+  fp->b = (fp->b + c) * 0x9e3779b97f4a7c15ULL;
+  fp->b ^= fp->b >> 29;
+}
+
+/**
+ * Normalize a grammar document for the cache so that documents parsed
+ * the same way look the same.  Whitespace next to markup is dropped, as
+ * the parser trims it from CDATA, and whitespace between attributes counts
+ * as one space.  Text, attribute values, <tag> content, comments and CDATA
+ * sections are kept as is.
+ * @param document the document
+ * @param normalized set to the normalized document
+ */
+static void normalize_document(const char *document, std::string &normalized)
+{
+  const char *markup = NULL;
+  const char *space = NULL;
+  int after_markup = 1;
+  char quote = 0;
+  const char *c;
+
+  normalized.clear();
+  normalized.reserve(strlen(document));
+  for (c = document; *c; c++) {
+    if (!quote && isspace((unsigned char)*c)) {
+      if (!space) {
+        space = c;
+      }
+      continue;
+    }
+    if (space) {
+      if (markup) {
+        if (*c != '>') {
+          normalized += ' ';
+        }
+      } else if (!after_markup && *c != '<') {
+        normalized.append(space, c - space);
+      }
+      space = NULL;
+    }
+    if (markup) {
+      normalized += *c;
+      if (quote) {
+        if (*c == quote) {
+          quote = 0;
+        }
+      } else if (*c == '"' || *c == '\'') {
+        quote = *c;
+      } else if (*c == '>') {
+        /* content of <tag>, but not <tag/>, is the interpretation */
+        const char *end = NULL;
+        if (!strncmp(markup, "<tag", 4) && (markup[4] == '>' || isspace((unsigned char)markup[4])) && *(c - 1) != '/') {
+          end = strstr(c, "</tag");
+        }
+        if (end) {
+          normalized.append(c + 1, end - c - 1);
+          c = end - 1;
+        }
+        markup = NULL;
+        after_markup = 1;
+      }
+      continue;
+    }
+    if (*c == '<') {
+      const char *end = NULL;
+      if (!strncmp(c, "<!--", 4) && (end = strstr(c + 4, "-->"))) {
+        end += 3;
+      } else if (!strncmp(c, "<![CDATA[", 9) && (end = strstr(c + 9, "]]>"))) {
+        end += 3;
+      }
+      if (end) {
+        normalized.append(c, end - c);
+        c = end - 1;
+        after_markup = 1;
+        continue;
+      }
+      markup = c;
+    } else {
+      after_markup = 0;
+    }
+    normalized += *c;
+  }
+}
+
+/**
+ * Fingerprint a normalized grammar document for the cache
+ * @param normalized the normalized document
+ * @param options grammar_option bits the grammar is built with
+ * @param key set to the fingerprint as FINGERPRINT_SIZE hex digits
+ * @return the first half of the fingerprint
+ */
+static uint64_t document_fingerprint(const std::string &normalized, int options, char *key)
+{
+  struct fingerprint fp = { 0xcbf29ce484222325ULL, 0x84222325cbf29ce4ULL };
+  size_t i;
+
+  for (i = 0; i < sizeof(options); i++) {
+    fingerprint_add(&fp, (char)(options >> (i * 8)));
+  }
+  for (i = 0; i < normalized.size(); i++) {
+    fingerprint_add(&fp, normalized[i]);
+  }
+  snprintf(key, FINGERPRINT_SIZE + 1, "%016llx%016llx", (unsigned long long)fp.a, (unsigned long long)fp.b);
+  return fp.a;
+}
+
+/**
+ * Remove a parsed entry from the cache and release its grammar
+ * @param shard the entry's shard, mutex locked
+ * @param entry the entry to evict
+ */
+static void cache_evict(struct grammar_cache_shard *shard, struct grammar_cache_entry *entry)
+{
+  if (entry->prev) {
+    entry->prev->next = entry->next;
+  } else {
+    shard->lru_head = entry->next;
+  }
+  if (entry->next) {
+    entry->next->prev = entry->prev;
+  } else {
+    shard->lru_tail = entry->prev;
+  }
+  switch_core_hash_delete(shard->entries, entry->key);
+  __atomic_sub_fetch(&cache.entries, 1, __ATOMIC_RELAXED);
+  cache_remove_size(entry->grammar);
+  shard->stats.evictions++;
+  srgs_grammar_unref(entry->grammar);
+  entry->state = GCS_EVICTED;
+  if (!entry->waiters) {
+    free(entry);
+  }
+}
+
+/**
+ * @return true if the cache holds more than its limits allow
+ */
+static int cache_is_full(void)
+{
+  unsigned long max_entries = __atomic_load_n(&cache.max_entries, __ATOMIC_RELAXED);
+  size_t max_bytes = __atomic_load_n(&cache.max_bytes, __ATOMIC_RELAXED);
+  return (max_entries && __atomic_load_n(&cache.entries, __ATOMIC_RELAXED) > max_entries) ||
+    (max_bytes && __atomic_load_n(&cache.resident_bytes, __ATOMIC_RELAXED) > max_bytes);
+}
+
+/**
+ * Evict the least recently used grammars of all shards until the cache is
+ * within its limits.  Each shard's least recently used entry is its LRU
+ * tail, so only the tails are compared.  Shard mutexes are taken one at a
+ * time, so no shard mutex may be held by the caller.
+ * @param keep last use of an entry that is never evicted, 0 if none
+ */
+static void cache_trim(unsigned long keep)
+{
+  while (cache_is_full()) {
+    struct grammar_cache_shard *oldest = NULL;
+    unsigned long oldest_used = 0;
+    int i;
+    for (i = 0; i < CACHE_SHARDS; i++) {
+      struct grammar_cache_shard *shard = &cache.shards[i];
+      switch_mutex_lock(shard->mutex);
+      if (shard->lru_tail && shard->lru_tail->used != keep && (!oldest || shard->lru_tail->used < oldest_used)) {
+        oldest = shard;
+        oldest_used = shard->lru_tail->used;
+      }
+      switch_mutex_unlock(shard->mutex);
+    }
+    if (!oldest) {
+      break;
+    }
+    switch_mutex_lock(oldest->mutex);
+    /* another caller may have used or evicted it meanwhile, then look again */
+    if (oldest->lru_tail && oldest->lru_tail->used == oldest_used && cache_is_full()) {
+      if(globals.logging_callback) {
+        globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "Evicting cached grammar %s\n", oldest->lru_tail->key);
+      }
+      cache_evict(oldest, oldest->lru_tail);
+    }
+    switch_mutex_unlock(oldest->mutex);
+  }
+}
+
+/**
+ * Make entry the most recently used
+ * @param shard the entry's shard, mutex locked
+ * @param entry the parsed entry, not in the LRU list
+ */
+static void cache_push(struct grammar_cache_shard *shard, struct grammar_cache_entry *entry)
+{
+  entry->used = __atomic_add_fetch(&cache.clock, 1, __ATOMIC_RELAXED);
+  entry->prev = NULL;
+  entry->next = shard->lru_head;
+  if (shard->lru_head) {
+    shard->lru_head->prev = entry;
+  } else {
+    shard->lru_tail = entry;
+  }
+  shard->lru_head = entry;
+}
+
+/**
+ * Make a cached entry the most recently used
+ * @param shard the entry's shard, mutex locked
+ * @param entry the parsed entry in the LRU list
+ */
+static void cache_touch(struct grammar_cache_shard *shard, struct grammar_cache_entry *entry)
+{
+  if (shard->lru_head != entry) {
+    entry->prev->next = entry->next;
+    if (entry->next) {
+      entry->next->prev = entry->prev;
+    } else {
+      shard->lru_tail = entry->prev;
+    }
+    cache_push(shard, entry);
+  } else {
+    entry->used = __atomic_add_fetch(&cache.clock, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Limit the grammars kept in the process-wide cache.  The least recently
+ * used grammars are evicted to stay within the limits.  Evicted grammars
+ * are destroyed once no caller holds a reference to them.
+ * @param max_entries maximum number of cached grammars, 0 for no limit
+ * @param max_bytes maximum estimated size of cached grammars, 0 for no limit
+ */
+void srgs_set_cache_limits(unsigned long max_entries, size_t max_bytes)
+{
+  __atomic_store_n(&cache.max_entries, max_entries, __ATOMIC_RELAXED);
+  __atomic_store_n(&cache.max_bytes, max_bytes, __ATOMIC_RELAXED);
+  cache_trim(0);
+}
+
+/**
+ * Get process-wide grammar cache statistics
+ * @param stats set to the statistics
+ */
+void srgs_get_cache_stats(struct srgs_cache_stats *stats)
+{
+  int i;
+  memset(stats, 0, sizeof(*stats));
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    switch_mutex_lock(cache.shards[i].mutex);
+    stats->hits += cache.shards[i].stats.hits;
+    stats->misses += cache.shards[i].stats.misses;
+    stats->evictions += cache.shards[i].stats.evictions;
+    switch_mutex_unlock(cache.shards[i].mutex);
   }
+  stats->entries = __atomic_load_n(&cache.entries, __ATOMIC_RELAXED);
+  stats->resident_bytes = __atomic_load_n(&cache.resident_bytes, __ATOMIC_RELAXED);
 }
 
 /**
@@ -898,39 +1575,367 @@ struct srgs_parser *srgs_parser_new(const char *uuid)
     parser = switch_core_alloc(pool, sizeof(*parser));
     parser->pool = pool;
     parser->uuid = cspeech_zstr(uuid) ? "" : switch_core_strdup(pool, uuid);
-    switch_core_hash_init(&parser->cache, pool);
-    switch_mutex_init(&parser->mutex, SWITCH_MUTEX_NESTED, pool);
+    parser->eager_compile = 0;
+    parser->tiered_compile = 0;
+    parser->grammars = new std::set<struct srgs_grammar *>;
+    switch_mutex_init(&parser->mutex, SWITCH_MUTEX_DEFAULT, pool);
   }
   return parser;
 }
 
 /**
- * Destroy the parser.
+ * Choose when grammars returned by this parser are compiled.  By default
+ * the matcher is built by the first match, which then waits for it.  With
+ * eager compilation srgs_parse() builds it and fails if the grammar can't
+ * be matched.
+ * @param parser the parser
+ * @param enabled true to compile grammars in srgs_parse()
+ */
+void srgs_parser_set_eager_compile(struct srgs_parser *parser, int enabled)
+{
+  if (parser) {
+    parser->eager_compile = enabled;
+  }
+}
+
+/**
+ * Choose if grammars parsed by this parser are compiled in the background.
+ * srgs_parse() then only builds the matcher program, which takes time
+ * linear in the grammar.  Matches simulate the program until a worker
+ * thread has built the DFA and regex, then use those without locking.
+ * Eager compilation takes precedence.  Tiered grammars are cached apart
+ * from the grammars of other parsers.
+ * @param parser the parser
+ * @param enabled true to compile grammars in the background
+ */
+void srgs_parser_set_tiered_compile(struct srgs_parser *parser, int enabled)
+{
+  if (parser) {
+    parser->tiered_compile = enabled;
+  }
+}
+
+/**
+ * Destroy the parser and release the grammars it returned.  Grammars stay
+ * in the process-wide cache and remain valid for callers holding their
+ * own references.
  * @param parser to destroy
  */
 void srgs_parser_destroy(struct srgs_parser *parser)
 {
   switch_memory_pool_t *pool = parser->pool;
-  switch_hash_index_t *hi = NULL;
-
-  /* clean up all cached grammars */
-  for (hi = switch_core_hash_first(parser->cache); hi; hi = switch_core_hash_next(hi)) {
-    struct srgs_grammar *grammar = NULL;
-    const void *key;
-    void *val;
-    switch_core_hash_this(hi, &key, NULL, &val);
-    grammar = (struct srgs_grammar *)val;
-    switch_assert(grammar);
-    srgs_grammar_destroy(grammar);
+  std::set<struct srgs_grammar *>::iterator grammar;
+
+  for (grammar = parser->grammars->begin(); grammar != parser->grammars->end(); grammar++) {
+    srgs_grammar_unref(*grammar);
   }
+  delete parser->grammars;
   switch_core_destroy_memory_pool(&pool);
 }
 
 /**
- * Create regexes
  * @param grammar the grammar
- * @param node root node
- * @param stream set to NULL
+ * @return true if the grammar regex has a named capture per <tag>.  Bigger
+ * <tag> tables are interpreted from the DFA accept state instead.
+ */
+static int regex_has_tags(struct srgs_grammar *grammar)
+{
+  return grammar->tag_count <= MAX_REGEX_TAGS;
+}
+
+/**
+ * @param node the node to check
+ * @return true if node or a rule it references has a <tag>
+ */
+static int sn_has_tags(struct srgs_node *node)
+{
+  struct srgs_node *child;
+  if (node->type == SNT_ITEM && node->value.item.tag) {
+    return 1;
+  }
+  if (node->type == SNT_REF) {
+    struct srgs_node *rule = node->value.ref.node;
+    if (rule->value.rule.tags == RT_UNKNOWN) {
+      rule->value.rule.tags = sn_has_tags(rule) ? RT_SOME : RT_NONE;
+    }
+    return rule->value.rule.tags == RT_SOME;
+  }
+  for (child = node->child; child; child = child->next) {
+    if (sn_has_tags(child)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * A <one-of> alternative that matches a fixed string
+ */
+struct regex_literal {
+  /** the string */
+  const char *string;
+  /** length of string */
+  size_t length;
+  /** the <tag> number, 0 if none */
+  int tag;
+};
+
+/**
+ * Write string to regex, escaping special PCRE regex characters
+ * @param stream the regex
+ * @param string the string
+ * @param length number of characters to write
+ */
+static void write_regex_string(switch_stream_handle_t *stream, const char *string, size_t length)
+{
+  size_t i;
+  for (i = 0; i < length; i++) {
+    switch (string[i]) {
+      case '[':
+      case '\\':
+      case '^':
+      case '$':
+      case '.':
+      case '|':
+      case '?':
+      case '*':
+      case '+':
+      case '(':
+      case ')':
+        /* escape special PCRE regex characters */
+        stream->write_function(stream, "\\%c", string[i]);
+        break;
+      default:
+        stream->write_function(stream, "%c", string[i]);
+        break;
+    }
+  }
+}
+
+/**
+ * @param node the <one-of> alternative
+ * @param literal set to the string node matches
+ * @return true if node matches a fixed string
+ */
+static int sn_literal(struct srgs_node *node, struct regex_literal *literal)
+{
+  struct srgs_node *string = NULL;
+  literal->tag = 0;
+  if (node->type == SNT_ITEM) {
+    struct srgs_node *child;
+    if (node->value.item.repeat_min != 1 || node->value.item.repeat_max != 1) {
+      return 0;
+    }
+    for (child = node->child; child; child = child->next) {
+      switch (child->type) {
+        case SNT_STRING:
+          if (string) {
+            return 0;
+          }
+          string = child;
+          break;
+        case SNT_ONE_OF:
+        case SNT_ITEM:
+        case SNT_REF:
+          return 0;
+        default:
+          break;
+      }
+    }
+    literal->tag = node->value.item.tag;
+  } else if (node->type == SNT_STRING) {
+    string = node;
+  }
+  if (!string || string->child || !*string->value.string) {
+    return 0;
+  }
+  literal->string = string->value.string;
+  literal->length = strlen(string->value.string);
+  return 1;
+}
+
+/**
+ * Write fixed string alternatives as a prefix trie so PCRE compares each
+ * shared prefix once.  Alternatives that may both match, where one is a
+ * prefix of the other, are kept in their original order.  A <tag>ged
+ * alternative captures its whole string with a lookbehind where it ends,
+ * so the interpretation and its span are unchanged.
+ * @param stream the regex
+ * @param literals the alternatives, in order, sharing their first depth characters
+ * @param depth number of characters already written
+ * @param top true if the alternatives are already in a group
+ */
+static void write_prefix_trie(switch_stream_handle_t *stream, const std::vector<struct regex_literal> &literals, size_t depth, int top)
+{
+  /* each branch holds alternatives continuing with the same character, an empty branch is an alternative that ends here */
+  std::vector<std::vector<struct regex_literal> > branches;
+  size_t i;
+  int j;
+
+  for (i = 0; i < literals.size(); i++) {
+    const struct regex_literal &literal = literals[i];
+    int found = 0;
+    if (literal.length > depth) {
+      /* join the latest branch with this character unless an alternative ending here comes after it */
+      for (j = (int)branches.size() - 1; j >= 0 && branches[j][0].length > depth; j--) {
+        if (branches[j][0].string[depth] == literal.string[depth]) {
+          branches[j].push_back(literal);
+          found = 1;
+          break;
+        }
+      }
+    }
+    if (!found) {
+      branches.push_back(std::vector<struct regex_literal>(1, literal));
+    }
+  }
+
+  if (!top && branches.size() > 1) {
+    stream->write_function(stream, "%s", "(?:");
+  }
+  for (i = 0; i < branches.size(); i++) {
+    const std::vector<struct regex_literal> &branch = branches[i];
+    if (i) {
+      stream->write_function(stream, "%s", "|");
+    }
+    if (branch[0].length == depth) {
+      if (branch[0].tag) {
+        stream->write_function(stream, "(?<=(?P<%d>", branch[0].tag);
+        write_regex_string(stream, branch[0].string, branch[0].length);
+        stream->write_function(stream, "%s", "))");
+      }
+    } else {
+      /* write the prefix shared by the whole branch */
+      size_t prefix = depth + 1;
+      size_t k;
+      for (; prefix < branch[0].length; prefix++) {
+        for (k = 1; k < branch.size() && branch[k].length > prefix && branch[k].string[prefix] == branch[0].string[prefix]; k++) {
+        }
+        if (k < branch.size()) {
+          break;
+        }
+      }
+      write_regex_string(stream, branch[0].string + depth, prefix - depth);
+      write_prefix_trie(stream, branch, prefix, 0);
+    }
+  }
+  if (!top && branches.size() > 1) {
+    stream->write_function(stream, "%s", ")");
+  }
+}
+
+/**
+ * @param node the <one-of> alternative
+ * @return the character if node matches exactly one character, 0 otherwise
+ */
+static char sn_single_char(struct srgs_node *node)
+{
+  if (node->type == SNT_ITEM && !node->value.item.tag && node->value.item.repeat_min == 1 && node->value.item.repeat_max == 1 && node->num_children == 1) {
+    node = node->child;
+  }
+  if (node->type == SNT_STRING && !node->child && node->value.string[0] && !node->value.string[1]) {
+    return node->value.string[0];
+  }
+  return 0;
+}
+
+/**
+ * @param node the <one-of>
+ * @return true if every alternative matches exactly one character
+ */
+static int is_char_class(struct srgs_node *node)
+{
+  struct srgs_node *item;
+  if (node->num_children < 2) {
+    return 0;
+  }
+  for (item = node->child; item; item = item->next) {
+    if (!sn_single_char(item)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @param node the node to check
+ * @return true if the regex of node can be repeated without a group around it
+ */
+static int is_regex_atom(struct srgs_node *node)
+{
+  if (node->type == SNT_STRING) {
+    return !node->child && node->value.string[0] && !node->value.string[1];
+  }
+  /* (?:...) or [...] */
+  return node->type == SNT_ONE_OF && node->num_children > 1;
+}
+
+/**
+ * Write the subroutine definitions of the rules called from the grammar regex
+ * @param grammar the grammar
+ * @param stream the grammar regex
+ */
+static void write_regex_subroutines(struct srgs_grammar *grammar, switch_stream_handle_t *stream)
+{
+  struct srgs_node *rule;
+  if (!grammar->subroutine_count) {
+    return;
+  }
+  stream->write_function(stream, "%s", "(?(DEFINE)");
+  for (rule = grammar->root->child; rule; rule = rule->next) {
+    if (rule->type == SNT_RULE && rule->value.rule.subroutine > 0) {
+      stream->write_function(stream, "(?<r%i>%s)", rule->value.rule.subroutine, rule->value.rule.regex);
+    }
+  }
+  stream->write_function(stream, "%s", ")");
+}
+
+static int create_program(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_program *prog, int tag);
+
+/**
+ * Check if no input matched by a rule is the start of another input it
+ * matches.  PCRE never backtracks into a subroutine call, so a call
+ * only agrees with the inlined rule when the rule can end in at most
+ * one place.
+ * @param grammar the grammar
+ * @param rule the <rule>
+ * @return true if calling the rule as a subroutine can't change the match
+ */
+static int rule_is_prefix_free(struct srgs_grammar *grammar, struct srgs_node *rule)
+{
+  struct fsm_program prog;
+  struct fsm_dfa *dfa;
+  int prefix_free = 1;
+  int state;
+  if (!create_program(grammar, rule, &prog, 0)) {
+    return 0;
+  }
+  fsm_program_emit(&prog, FOP_MATCH, 0, 0, 0, 0);
+  if (!(dfa = fsm_dfa_create(&prog, MAX_DFA_STATES))) {
+    return 0;
+  }
+  for (state = 0; state < dfa->num_states && prefix_free; state++) {
+    int c;
+    if (!dfa->accept[state]) {
+      continue;
+    }
+    /* input may go on after a match */
+    for (c = 1; c < dfa->num_classes; c++) {
+      if (dfa->transitions[state * dfa->num_classes + c] != FSM_DEAD_STATE) {
+        prefix_free = 0;
+        break;
+      }
+    }
+  }
+  fsm_dfa_destroy(dfa);
+  return prefix_free;
+}
+
+/**
+ * Create regexes
+ * @param grammar the grammar
+ * @param node root node
+ * @param stream set to NULL
  * @return 1 if successful
  */
 static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node, switch_stream_handle_t *stream)
@@ -941,14 +1946,15 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
       if (node->child) {
         int num_rules = 0;
         struct srgs_node *child = node->child;
+        switch_stream_handle_t new_stream = { 0 };
+        SWITCH_STANDARD_STREAM(new_stream);
         if (grammar->root_rule) {
           if (!create_regexes(grammar, grammar->root_rule, NULL)) {
+            switch_safe_free(new_stream.data);
             return 0;
           }
-          grammar->regex = switch_core_sprintf(grammar->pool, "^%s$", grammar->root_rule->value.rule.regex);
+          new_stream.write_function(&new_stream, "^%s$", grammar->root_rule->value.rule.regex);
         } else {
-          switch_stream_handle_t new_stream = { 0 };
-          SWITCH_STANDARD_STREAM(new_stream);
           if (node->num_children > 1) {
             new_stream.write_function(&new_stream, "%s", "^(?:");
           } else {
@@ -972,9 +1978,10 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
           } else {
             new_stream.write_function(&new_stream, "%s", "$");
           }
-          grammar->regex = strdup(new_stream.data);
-          switch_safe_free(new_stream.data);
         }
+        write_regex_subroutines(grammar, &new_stream);
+        grammar->regex = switch_core_strdup(grammar->pool, new_stream.data);
+        switch_safe_free(new_stream.data);
         if(globals.logging_callback) {
           globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "document regex = %s\n", grammar->regex);
         }
@@ -996,7 +2003,7 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
             return 0;
           }
         }
-        node->value.rule.regex = strdup(new_stream.data);
+        node->value.rule.regex = switch_core_strdup(grammar->pool, new_stream.data);
         if(globals.logging_callback) {
           globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "%s regex = %s\n", node->value.rule.id, node->value.rule.regex);
         }
@@ -1004,28 +2011,7 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
       }
       break;
     case SNT_STRING: {
-      int i;
-      for (i = 0; i < strlen(node->value.string); i++) {
-        switch (node->value.string[i]) {
-          case '[':
-          case '\\':
-          case '^':
-          case '$':
-          case '.':
-          case '|':
-          case '?':
-          case '*':
-          case '+':
-          case '(':
-          case ')':
-            /* escape special PCRE regex characters */
-            stream->write_function(stream, "\\%c", node->value.string[i]);
-            break;
-          default:
-            stream->write_function(stream, "%c", node->value.string[i]);
-            break;
-        }
-      }
+      write_regex_string(stream, node->value.string, strlen(node->value.string));
       if (node->child) {
         if (!create_regexes(grammar, node->child, stream)) {
           return 0;
@@ -1036,52 +2022,83 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
     case SNT_ITEM:
       if (node->child) {
         struct srgs_node *item = node->child;
-        if (node->value.item.repeat_min != 1 || node->value.item.repeat_max != 1 || node->value.item.tag) {
-          if (node->value.item.tag) {
-            stream->write_function(stream, "(?P<%d>", node->value.item.tag);
-          } else {
-            stream->write_function(stream, "%s", "(?:");
-          }
+        int repeated = node->value.item.repeat_min != 1 || node->value.item.repeat_max != 1;
+        int tag = regex_has_tags(grammar) ? node->value.item.tag : 0;
+        int group = tag || (repeated && !(node->num_children == 1 && is_regex_atom(node->child)));
+        if (tag) {
+          stream->write_function(stream, "(?P<%d>", tag);
+        } else if (group) {
+          stream->write_function(stream, "%s", "(?:");
         }
         for(; item; item = item->next) {
           if (!create_regexes(grammar, item, stream)) {
             return 0;
           }
         }
-        if (node->value.item.repeat_min != 1 || node->value.item.repeat_max != 1) {
+        if (group) {
+          stream->write_function(stream, "%s", ")");
+        }
+        if (repeated) {
           if (node->value.item.repeat_min != node->value.item.repeat_max) {
             if (node->value.item.repeat_min == 0 && node->value.item.repeat_max == INT_MAX) {
-                stream->write_function(stream, ")*");
+                stream->write_function(stream, "*");
             } else if (node->value.item.repeat_min == 0 && node->value.item.repeat_max == 1) {
-                stream->write_function(stream, ")?");
+                stream->write_function(stream, "?");
             } else if (node->value.item.repeat_min == 1 && node->value.item.repeat_max == INT_MAX) {
-              stream->write_function(stream, ")+");
+              stream->write_function(stream, "+");
             } else if (node->value.item.repeat_max == INT_MAX) {
-              stream->write_function(stream, "){%i,1000}", node->value.item.repeat_min);
+              stream->write_function(stream, "{%i,}", node->value.item.repeat_min);
             } else {
-              stream->write_function(stream, "){%i,%i}", node->value.item.repeat_min, node->value.item.repeat_max);
+              stream->write_function(stream, "{%i,%i}", node->value.item.repeat_min, node->value.item.repeat_max);
             }
           } else {
-            stream->write_function(stream, "){%i}", node->value.item.repeat_min);
+            stream->write_function(stream, "{%i}", node->value.item.repeat_min);
           }
-        } else if (node->value.item.tag) {
-          stream->write_function(stream, "%s", ")");
         }
       }
       break;
     case SNT_ONE_OF:
-      if (node->child) {
+      if (is_char_class(node)) {
+        struct srgs_node *item = node->child;
+        stream->write_function(stream, "%s", "[");
+        for (; item; item = item->next) {
+          char c = sn_single_char(item);
+          if (c == '\\' || c == ']' || c == '^' || c == '-') {
+            stream->write_function(stream, "\\%c", c);
+          } else {
+            stream->write_function(stream, "%c", c);
+          }
+        }
+        stream->write_function(stream, "%s", "]");
+      } else if (node->child) {
         struct srgs_node *item = node->child;
         if (node->num_children > 1) {
           stream->write_function(stream, "%s", "(?:");
         }
-        for (; item; item = item->next) {
+        while (item) {
+          std::vector<struct regex_literal> literals;
+          struct regex_literal literal;
           if (item != node->child) {
             stream->write_function(stream, "%s", "|");
           }
+          if (grammar->regex_prefix_factoring) {
+            struct srgs_node *next = item;
+            for (; next && sn_literal(next, &literal); next = next->next) {
+              if (!regex_has_tags(grammar)) {
+                literal.tag = 0;
+              }
+              literals.push_back(literal);
+            }
+            if (literals.size() > 1) {
+              write_prefix_trie(stream, literals, 0, 1);
+              item = next;
+              continue;
+            }
+          }
           if (!create_regexes(grammar, item, stream)) {
             return 0;
           }
+          item = item->next;
         }
         if (node->num_children > 1) {
           stream->write_function(stream, "%s", ")");
@@ -1101,7 +2118,16 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
       if (!rule->value.rule.regex) {
         return 0;
       }
-      stream->write_function(stream, "%s", rule->value.rule.regex);
+      if (grammar->regex_subroutines && (!regex_has_tags(grammar) || !sn_has_tags(node)) && !rule->value.rule.subroutine) {
+        /* a call can't backtrack, so only rules matching one way are called */
+        rule->value.rule.subroutine = rule_is_prefix_free(grammar, rule) ? ++grammar->subroutine_count : -1;
+      }
+      if (grammar->regex_subroutines && (!regex_has_tags(grammar) || !sn_has_tags(node)) && rule->value.rule.subroutine > 0) {
+        /* define once, call wherever referenced */
+        stream->write_function(stream, "(?&r%i)", rule->value.rule.subroutine);
+      } else {
+        stream->write_function(stream, "%s", rule->value.rule.regex);
+      }
       break;
     }
     case SNT_ANY:
@@ -1113,6 +2139,122 @@ static int create_regexes(struct srgs_grammar *grammar, struct srgs_node *node,
   return 1;
 }
 
+/**
+ * Map regex capture numbers to <tag> numbers so the interpretation
+ * can be found without looking up each named substring.
+ * @param grammar the grammar with a compiled regex
+ */
+static void create_capture_tags(struct srgs_grammar *grammar)
+{
+  unsigned char *name_table = NULL;
+  int name_entry_size = 0;
+  int capture_count = 0;
+  int name_count = 0;
+  int i;
+
+  if (pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_CAPTURECOUNT, &capture_count) ||
+    pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_NAMECOUNT, &name_count) ||
+    pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_NAMEENTRYSIZE, &name_entry_size) ||
+    pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_NAMETABLE, &name_table)) {
+    return;
+  }
+  grammar->capture_tags = (int *)switch_core_alloc(grammar->pool, (capture_count + 1) * sizeof(int));
+  for (i = 0; i < name_count; i++) {
+    /* entry is 2 byte big-endian capture number followed by the name */
+    unsigned char *entry = name_table + i * name_entry_size;
+    grammar->capture_tags[(entry[0] << 8) | entry[1]] = atoi((const char *)entry + 2);
+  }
+}
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+/**
+ * Destroy a thread's JIT stack when the thread exits
+ * @param stack the JIT stack
+ */
+static void jit_stack_destroy(void *stack)
+{
+  pcre_jit_stack_free((pcre_jit_stack *)stack);
+}
+
+/**
+ * Get the calling thread's JIT stack so that matching
+ * never shares a stack between threads.
+ * @param data unused
+ * @return the stack, or NULL to use the machine stack
+ */
+static pcre_jit_stack *get_jit_stack(void *data)
+{
+  pcre_jit_stack *stack = (pcre_jit_stack *)pthread_getspecific(globals.jit_stack_key);
+  if (!stack && (stack = pcre_jit_stack_alloc(JIT_STACK_START_SIZE, JIT_STACK_MAX_SIZE))) {
+    pthread_setspecific(globals.jit_stack_key, stack);
+  }
+  return stack;
+}
+#endif
+
+/**
+ * Study compiled regex, JIT compiling it if PCRE supports JIT
+ * @param grammar the grammar with a compiled regex
+ */
+static void study_regex(struct srgs_grammar *grammar)
+{
+  const char *errptr = NULL;
+  int options = 0;
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (globals.jit_available) {
+    options |= PCRE_STUDY_JIT_COMPILE;
+#ifdef PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE
+    options |= PCRE_STUDY_JIT_PARTIAL_SOFT_COMPILE;
+#endif
+  }
+#endif
+
+  grammar->extra = pcre_study(grammar->compiled_regex, options, &errptr);
+  if (errptr) {
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_WARNING, "Failed to study grammar regex: %s\n", errptr);
+    }
+    return;
+  }
+
+#ifdef PCRE_STUDY_JIT_COMPILE
+  if (grammar->extra && (grammar->extra->flags & PCRE_EXTRA_EXECUTABLE_JIT)) {
+    pcre_assign_jit_stack(grammar->extra, get_jit_stack, NULL);
+  } else if (globals.jit_available) {
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Grammar regex not JIT compiled, using interpreter\n");
+    }
+  }
+#endif
+}
+
+/**
+ * @param grammar the grammar with a compiled regex
+ * @return the memory used by the compiled regex, its study data and JIT code
+ */
+static size_t compiled_regex_size(struct srgs_grammar *grammar)
+{
+  size_t size = 0;
+  size_t part;
+  int capture_count = 0;
+  if (!pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_SIZE, &part)) {
+    size += part;
+  }
+  if (grammar->extra && !pcre_fullinfo(grammar->compiled_regex, grammar->extra, PCRE_INFO_STUDYSIZE, &part)) {
+    size += part;
+  }
+#ifdef PCRE_INFO_JITSIZE
+  if (grammar->extra && !pcre_fullinfo(grammar->compiled_regex, grammar->extra, PCRE_INFO_JITSIZE, &part)) {
+    size += part;
+  }
+#endif
+  if (grammar->capture_tags && !pcre_fullinfo(grammar->compiled_regex, NULL, PCRE_INFO_CAPTURECOUNT, &capture_count)) {
+    size += (capture_count + 1) * sizeof(int);
+  }
+  return size;
+}
+
 /**
  * Compile regex
  */
@@ -1130,264 +2272,2254 @@ static pcre *get_compiled_regex(struct srgs_grammar *grammar)
     return NULL;
   }
 
+  if (is_published(grammar, GA_COMPILED_REGEX)) {
+    return grammar->compiled_regex;
+  }
+
   switch_mutex_lock(grammar->mutex);
-  if (!grammar->compiled_regex && (regex = srgs_grammar_to_regex(grammar))) {
+  if (!is_published(grammar, GA_COMPILED_REGEX) && (regex = srgs_grammar_to_regex(grammar))) {
     if (!(grammar->compiled_regex = pcre_compile(regex, options, &errptr, &erroffset, NULL))) {
       if(globals.logging_callback) {
         globals.logging_callback(grammar, CSPEECH_LOG_WARNING, "Failed to compile grammar regex: %s\n", regex);
       }
+    } else {
+      create_capture_tags(grammar);
+      study_regex(grammar);
+      grammar_add_size(grammar, compiled_regex_size(grammar));
     }
+    publish(grammar, GA_COMPILED_REGEX);
   }
   switch_mutex_unlock(grammar->mutex);
   return grammar->compiled_regex;
 }
 
 /**
- * Resolve all unresolved references and detect loops.
+ * Emit one repeat of an <item>
  * @param grammar the grammar
- * @param node the current node
- * @param level the recursion level
+ * @param node the <item>
+ * @param prog the program to append to
+ * @param tag the lowest enclosing <tag> number, 0 if none
+ * @return 1 if successful
  */
-static int resolve_refs(struct srgs_grammar *grammar, struct srgs_node *node, int level)
+static int create_item_program(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_program *prog, int tag)
 {
-  sn_log_node_open(node);
-  if (node->visited) {
-    if(globals.logging_callback) {
-      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Loop detected.\n");
+  struct srgs_node *item;
+  if (node->value.item.tag) {
+    fsm_program_emit(prog, FOP_OPEN, 0, node->value.item.tag, 0, 0);
+  }
+  for (item = node->child; item; item = item->next) {
+    if (!create_program(grammar, item, prog, tag)) {
+      return 0;
     }
-    return 0;
   }
-  node->visited = 1;
+  if (node->value.item.tag) {
+    fsm_program_emit(prog, FOP_CLOSE, 0, node->value.item.tag, 0, 0);
+  }
+  return 1;
+}
 
-  if (level > MAX_RECURSION) {
+/**
+ * Create matcher program.  Alternatives and repeats are emitted in
+ * the same order as create_regexes() so both engines agree.
+ * @param grammar the grammar
+ * @param node the node to emit
+ * @param prog the program to append to
+ * @param tag the lowest enclosing <tag> number, 0 if none
+ * @return 1 if successful
+ */
+static int create_program(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_program *prog, int tag)
+{
+  if (prog->insts.size() > MAX_PROGRAM_SIZE) {
     if(globals.logging_callback) {
-      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Recursion too deep.\n");
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "program too large\n");
     }
     return 0;
   }
-
-  if (node->type == SNT_GRAMMAR && node->value.root) {
-    struct srgs_node *rule = (struct srgs_node *)grammar->rules[node->value.root];
-    if (!rule) {
-      if(globals.logging_callback) {
-        globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Root rule not found: %s\n", node->value.root);
+  switch (node->type) {
+    case SNT_GRAMMAR:
+      if (grammar->root_rule) {
+        if (!create_program(grammar, grammar->root_rule, prog, tag)) {
+          return 0;
+        }
+      } else {
+        std::vector<int> jmps;
+        struct srgs_node *child;
+        int split = -1;
+        size_t i;
+        for (child = node->child; child; child = child->next) {
+          if (child->type == SNT_RULE && child->value.rule.is_public) {
+            if (split >= 0) {
+              jmps.push_back(fsm_program_emit(prog, FOP_JMP, 0, 0, 0, 0));
+              prog->insts[split].y = prog->insts.size();
+            }
+            split = fsm_program_emit(prog, FOP_SPLIT, 0, 0, prog->insts.size() + 1, 0);
+            if (!create_program(grammar, child, prog, tag)) {
+              return 0;
+            }
+          }
+        }
+        if (split >= 0) {
+          /* last rule has no alternative */
+          prog->insts[split].op = FOP_JMP;
+        }
+        for (i = 0; i < jmps.size(); i++) {
+          prog->insts[jmps[i]].x = prog->insts.size();
+        }
       }
-      return 0;
+      fsm_program_emit(prog, FOP_MATCH, 0, 0, 0, 0);
+      break;
+    case SNT_RULE: {
+      struct srgs_node *item = node->child;
+      for (; item; item = item->next) {
+        if (!create_program(grammar, item, prog, tag)) {
+          return 0;
+        }
+      }
+      break;
     }
-    grammar->root_rule = rule;
+    case SNT_STRING: {
+      const char *c;
+      for (c = node->value.string; *c; c++) {
+        fsm_program_emit(prog, FOP_CHAR, *c, tag, 0, 0);
+      }
+      if (node->child) {
+        if (!create_program(grammar, node->child, prog, tag)) {
+          return 0;
+        }
+      }
+      break;
+    }
+    case SNT_ITEM:
+      if (node->child) {
+        std::vector<int> splits;
+        int repeat_min = node->value.item.repeat_min;
+        int repeat_max = node->value.item.repeat_max;
+        int i;
+        tag = fsm_tag_min(tag, node->value.item.tag);
+        if (repeat_min > 1 || (repeat_max != INT_MAX && repeat_max > 1)) {
+          /* count repeats instead of copying the item for each one */
+          struct fsm_counter counter = { repeat_min, repeat_max };
+          int number = prog->counters.size();
+          int repeat;
+          prog->counters.push_back(counter);
+          repeat = fsm_program_emit(prog, FOP_REPEAT, 0, number, prog->insts.size() + 1, 0);
+          if (!create_item_program(grammar, node, prog, tag)) {
+            return 0;
+          }
+          fsm_program_emit(prog, FOP_COUNT, 0, number, repeat, 0);
+          prog->insts[repeat].y = prog->insts.size();
+          break;
+        }
+        for (i = 0; i < repeat_min || (repeat_max == INT_MAX && i == repeat_min) || (repeat_max != INT_MAX && i < repeat_max); i++) {
+          int loop = prog->insts.size();
+          if (loop > MAX_PROGRAM_SIZE) {
+            return 0;
+          }
+          if (i >= repeat_min) {
+            /* greedy - prefer another repeat */
+            splits.push_back(fsm_program_emit(prog, FOP_SPLIT, 0, 0, loop + 1, 0));
+          }
+          if (!create_item_program(grammar, node, prog, tag)) {
+            return 0;
+          }
+          if (repeat_max == INT_MAX && i >= repeat_min) {
+            fsm_program_emit(prog, FOP_JMP, 0, 0, loop, 0);
+            break;
+          }
+        }
+        for (i = 0; i < (int)splits.size(); i++) {
+          prog->insts[splits[i]].y = prog->insts.size();
+        }
+      }
+      break;
+    case SNT_ONE_OF:
+      if (node->child) {
+        std::vector<int> jmps;
+        struct srgs_node *item = node->child;
+        size_t i;
+        for (; item; item = item->next) {
+          int split = -1;
+          if (item->next) {
+            split = fsm_program_emit(prog, FOP_SPLIT, 0, 0, prog->insts.size() + 1, 0);
+          }
+          if (!create_program(grammar, item, prog, tag)) {
+            return 0;
+          }
+          if (split >= 0) {
+            jmps.push_back(fsm_program_emit(prog, FOP_JMP, 0, 0, 0, 0));
+            prog->insts[split].y = prog->insts.size();
+          }
+        }
+        for (i = 0; i < jmps.size(); i++) {
+          prog->insts[jmps[i]].x = prog->insts.size();
+        }
+      }
+      break;
+    case SNT_REF:
+      return create_program(grammar, node->value.ref.node, prog, tag);
+    case SNT_ANY:
+    default:
+      /* ignore */
+      break;
   }
+  return 1;
+}
 
-  if (node->type == SNT_UNRESOLVED_REF) {
-    /* resolve reference to local rule- drop first character # from URI */
-    struct srgs_node *rule = (struct srgs_node *)grammar->rules[node->value.ref.uri + 1];
-    if (!rule) {
+/**
+ * Create the matcher program.  This is linear in the grammar, unlike the DFA.
+ * @param grammar the grammar
+ * @return the program or NULL if the grammar is too large
+ */
+static struct fsm_program *get_matcher_program(struct srgs_grammar *grammar)
+{
+  if (is_published(grammar, GA_PROGRAM)) {
+    return grammar->program;
+  }
+
+  switch_mutex_lock(grammar->mutex);
+  if (!is_published(grammar, GA_PROGRAM)) {
+    grammar->program = new fsm_program;
+    if (!create_program(grammar, grammar->root, grammar->program, 0)) {
+      delete grammar->program;
+      grammar->program = NULL;
+    } else {
+      grammar_add_size(grammar, fsm_program_size(grammar->program));
+    }
+    publish(grammar, GA_PROGRAM);
+  }
+  switch_mutex_unlock(grammar->mutex);
+  return grammar->program;
+}
+
+/**
+ * Compile DFA
+ */
+static struct fsm_dfa *get_compiled_dfa(struct srgs_grammar *grammar)
+{
+  if (is_published(grammar, GA_DFA)) {
+    return grammar->dfa;
+  }
+
+  switch_mutex_lock(grammar->mutex);
+  if (!is_published(grammar, GA_DFA)) {
+    struct fsm_program *program = get_matcher_program(grammar);
+    if (program) {
+      grammar->dfa = fsm_dfa_create(program, MAX_DFA_STATES);
+    }
+    if (grammar->dfa) {
+      grammar_add_size(grammar, fsm_dfa_size(grammar->dfa));
       if(globals.logging_callback) {
-        globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Local rule not found: %s\n", node->value.ref.uri);
+        globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "document dfa = %i states\n", grammar->dfa->num_states);
+      }
+    } else {
+      /* the program is kept to interpret grammars with too many <tag>s for the regex */
+      if(globals.logging_callback) {
+        globals.logging_callback(grammar, CSPEECH_LOG_WARNING, "Failed to compile grammar DFA, using PCRE\n");
       }
+    }
+    publish(grammar, GA_DFA);
+  }
+  switch_mutex_unlock(grammar->mutex);
+  return grammar->dfa;
+}
+
+/**
+ * Positions of part of a grammar in its Glushkov automaton
+ */
+struct glushkov_part {
+  /** true if the part can match empty input */
+  int nullable;
+  /** positions the part can start at */
+  std::vector<int> first;
+  /** positions the part can end at */
+  std::vector<int> last;
+};
+
+/**
+ * Reset a part to match only empty input
+ * @param part the part
+ */
+static void glushkov_part_empty(struct glushkov_part *part)
+{
+  part->nullable = 1;
+  part->first.clear();
+  part->last.clear();
+}
+
+/**
+ * Append a part to another
+ * @param positions the automaton
+ * @param part the part to append to
+ * @param next the part that follows it
+ */
+static void glushkov_concat(struct fsm_positions *positions, struct glushkov_part *part, const struct glushkov_part *next)
+{
+  size_t i;
+  for (i = 0; i < part->last.size(); i++) {
+    std::vector<int> &follow = positions->follow[part->last[i]];
+    follow.insert(follow.end(), next->first.begin(), next->first.end());
+  }
+  if (part->nullable) {
+    part->first.insert(part->first.end(), next->first.begin(), next->first.end());
+  }
+  if (next->nullable) {
+    part->last.insert(part->last.end(), next->last.begin(), next->last.end());
+  } else {
+    part->last = next->last;
+  }
+  part->nullable = part->nullable && next->nullable;
+}
+
+/**
+ * Add an alternative to a part
+ * @param part the part
+ * @param alternative the alternative to add
+ */
+static void glushkov_alternate(struct glushkov_part *part, const struct glushkov_part *alternative)
+{
+  part->first.insert(part->first.end(), alternative->first.begin(), alternative->first.end());
+  part->last.insert(part->last.end(), alternative->last.begin(), alternative->last.end());
+  part->nullable = part->nullable || alternative->nullable;
+}
+
+/**
+ * Let a part repeat any number of times after the first
+ * @param positions the automaton
+ * @param part the part
+ */
+static void glushkov_loop(struct fsm_positions *positions, struct glushkov_part *part)
+{
+  size_t i;
+  for (i = 0; i < part->last.size(); i++) {
+    std::vector<int> &follow = positions->follow[part->last[i]];
+    follow.insert(follow.end(), part->first.begin(), part->first.end());
+  }
+}
+
+static int create_positions(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_positions *positions, struct glushkov_part *part);
+
+/**
+ * Add the positions of a sequence of nodes
+ * @param grammar the grammar
+ * @param node the first node
+ * @param positions the automaton to add to
+ * @param part set to the positions of the sequence
+ * @return 1 if successful
+ */
+static int create_sequence_positions(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_positions *positions, struct glushkov_part *part)
+{
+  glushkov_part_empty(part);
+  for (; node; node = node->next) {
+    struct glushkov_part next;
+    if (!create_positions(grammar, node, positions, &next)) {
       return 0;
     }
+    glushkov_concat(positions, part, &next);
+  }
+  return 1;
+}
 
-    /* link to rule */
-    node->type = SNT_REF;
-    node->value.ref.node = rule;
+/**
+ * Add the Glushkov positions of a node.  Every repeat and rule reference
+ * gets its own positions, like the regex.
+ * @param grammar the grammar
+ * @param node the node to add
+ * @param positions the automaton to add to
+ * @param part set to the positions of the node
+ * @return 1 if successful, 0 if the automaton is too big
+ */
+static int create_positions(struct srgs_grammar *grammar, struct srgs_node *node, struct fsm_positions *positions, struct glushkov_part *part)
+{
+  glushkov_part_empty(part);
+  if (positions->chars.size() > FSM_GLUSHKOV_MAX_POSITIONS) {
+    return 0;
+  }
+  switch (node->type) {
+    case SNT_GRAMMAR:
+      if (grammar->root_rule) {
+        return create_positions(grammar, grammar->root_rule, positions, part);
+      } else {
+        struct srgs_node *child;
+        part->nullable = 0;
+        for (child = node->child; child; child = child->next) {
+          if (child->type == SNT_RULE && child->value.rule.is_public) {
+            struct glushkov_part rule;
+            if (!create_positions(grammar, child, positions, &rule)) {
+              return 0;
+            }
+            glushkov_alternate(part, &rule);
+          }
+        }
+      }
+      break;
+    case SNT_RULE:
+      return create_sequence_positions(grammar, node->child, positions, part);
+    case SNT_STRING: {
+      const char *c;
+      for (c = node->value.string; *c; c++) {
+        struct glushkov_part next;
+        next.nullable = 0;
+        next.first.push_back(fsm_positions_add(positions, *c));
+        next.last = next.first;
+        glushkov_concat(positions, part, &next);
+      }
+      if (node->child) {
+        struct glushkov_part next;
+        if (!create_positions(grammar, node->child, positions, &next)) {
+          return 0;
+        }
+        glushkov_concat(positions, part, &next);
+      }
+      break;
+    }
+    case SNT_ITEM:
+      if (node->child) {
+        int repeat_min = node->value.item.repeat_min;
+        int repeat_max = node->value.item.repeat_max;
+        int i;
+        /* E{min,} is E{min-1} E+ and E{min,max} is E{min} then max-min optional copies of E */
+        for (i = 0; i < repeat_min || (repeat_max == INT_MAX && i == 0) || (repeat_max != INT_MAX && i < repeat_max); i++) {
+          struct glushkov_part copy;
+          if (!create_sequence_positions(grammar, node->child, positions, &copy)) {
+            return 0;
+          }
+          copy.nullable = copy.nullable || i >= repeat_min;
+          if (copy.first.empty()) {
+            /* more copies of an item without input change nothing */
+            glushkov_concat(positions, part, &copy);
+            break;
+          }
+          if (repeat_max == INT_MAX && i + 1 >= repeat_min) {
+            glushkov_loop(positions, &copy);
+            glushkov_concat(positions, part, &copy);
+            break;
+          }
+          glushkov_concat(positions, part, &copy);
+        }
+      }
+      break;
+    case SNT_ONE_OF:
+      if (node->child) {
+        struct srgs_node *item;
+        part->nullable = 0;
+        for (item = node->child; item; item = item->next) {
+          struct glushkov_part alternative;
+          if (!create_positions(grammar, item, positions, &alternative)) {
+            return 0;
+          }
+          glushkov_alternate(part, &alternative);
+        }
+      }
+      break;
+    case SNT_REF:
+      return create_positions(grammar, node->value.ref.node, positions, part);
+    case SNT_ANY:
+    default:
+      /* ignore */
+      break;
+  }
+  return 1;
+}
+
+/**
+ * Build the bit-parallel Glushkov automaton straight from the grammar tree
+ * @param grammar the grammar
+ * @return the automaton or NULL if the grammar has too many positions
+ */
+static struct fsm_glushkov *get_compiled_glushkov(struct srgs_grammar *grammar)
+{
+  if (is_published(grammar, GA_GLUSHKOV)) {
+    return grammar->glushkov;
+  }
+
+  switch_mutex_lock(grammar->mutex);
+  if (!is_published(grammar, GA_GLUSHKOV)) {
+    struct fsm_positions positions;
+    struct glushkov_part root;
+    fsm_positions_add(&positions, 0);
+    if (create_positions(grammar, grammar->root, &positions, &root)) {
+      positions.follow[0] = root.first;
+      positions.accept = root.last;
+      if (root.nullable) {
+        positions.accept.push_back(0);
+      }
+      grammar->glushkov = fsm_glushkov_create(&positions);
+    }
+    if (grammar->glushkov) {
+      grammar_add_size(grammar, fsm_glushkov_size(grammar->glushkov));
+      if(globals.logging_callback) {
+        globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "document glushkov automaton = %i positions\n", grammar->glushkov->num_positions);
+      }
+    } else if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "grammar too large for glushkov automaton\n");
+    }
+    publish(grammar, GA_GLUSHKOV);
+  }
+  switch_mutex_unlock(grammar->mutex);
+  return grammar->glushkov;
+}
+
+/**
+ * Shape of a grammar, used to pick the engine that matches it fastest
+ */
+struct grammar_shape {
+  /** characters used */
+  bool alphabet[256];
+  /** number of characters used */
+  int alphabet_size;
+  /** positions of rules already measured */
+  std::map<struct srgs_node *, double> rules;
+};
+
+/**
+ * Count the input positions of a node with each repeat copied out.  This
+ * is roughly how many states a DFA needs unless repeats overlap.
+ * @param grammar the grammar
+ * @param node the node to measure
+ * @param shape the shape to add to
+ * @return the number of positions
+ */
+static double sn_positions(struct srgs_grammar *grammar, struct srgs_node *node, struct grammar_shape *shape)
+{
+  struct srgs_node *child;
+  double positions = 0;
+  switch (node->type) {
+    case SNT_GRAMMAR:
+      if (grammar->root_rule) {
+        return sn_positions(grammar, grammar->root_rule, shape);
+      }
+      for (child = node->child; child; child = child->next) {
+        if (child->type == SNT_RULE && child->value.rule.is_public) {
+          positions += sn_positions(grammar, child, shape);
+        }
+      }
+      return positions;
+    case SNT_REF: {
+      std::map<struct srgs_node *, double>::iterator rule = shape->rules.find(node->value.ref.node);
+      if (rule != shape->rules.end()) {
+        return rule->second;
+      }
+      positions = sn_positions(grammar, node->value.ref.node, shape);
+      shape->rules[node->value.ref.node] = positions;
+      return positions;
+    }
+    case SNT_STRING: {
+      const unsigned char *c;
+      for (c = (const unsigned char *)node->value.string; *c; c++) {
+        if (!shape->alphabet[*c]) {
+          shape->alphabet[*c] = true;
+          shape->alphabet_size++;
+        }
+        positions++;
+      }
+      break;
+    }
+    case SNT_RULE:
+    case SNT_ITEM:
+    case SNT_ONE_OF:
+      break;
+    default:
+      return 0;
+  }
+  for (child = node->child; child; child = child->next) {
+    positions += sn_positions(grammar, child, shape);
+  }
+  if (node->type == SNT_ITEM) {
+    int copies = node->value.item.repeat_max == INT_MAX ? node->value.item.repeat_min : node->value.item.repeat_max;
+    if (copies > 1) {
+      positions *= copies;
+    }
+  }
+  return positions;
+}
+
+/**
+ * Pick the engine that matches the grammar fastest.  The DFA costs one
+ * lookup per input character, so it is tried first unless the grammar
+ * is clearly too big for it.  The Glushkov automaton is next, it costs a
+ * few word operations per character and never blows up.  Its position
+ * sets don't say which <tag> PCRE would pick, so grammars with <tag>s
+ * would also simulate the program for every match and skip it.  PCRE comes
+ * after that, then simulating the matcher program, which handles any
+ * grammar the program fits.  The candidates are compiled without holding
+ * the grammar mutex, each is only built once however many callers pick.
+ * @param grammar the grammar
+ * @return the engine
+ */
+static enum srgs_match_engine select_engine(struct srgs_grammar *grammar)
+{
+  struct grammar_shape shape;
+  enum srgs_match_engine engine;
+  double positions;
+
+  if (is_published(grammar, GA_ENGINE)) {
+    return grammar->selected_engine;
+  }
+
+  memset(shape.alphabet, 0, sizeof(shape.alphabet));
+  shape.alphabet_size = 0;
+  positions = sn_positions(grammar, grammar->root, &shape);
+  if (positions <= MAX_DFA_STATES && positions * (shape.alphabet_size + 1) <= MAX_DFA_TRANSITIONS && get_compiled_dfa(grammar)) {
+    engine = SME_DFA;
+  } else if (!grammar->tag_count && positions <= FSM_GLUSHKOV_MAX_POSITIONS && get_compiled_glushkov(grammar)) {
+    engine = SME_GLUSHKOV;
+  } else if (regex_has_tags(grammar) && get_compiled_regex(grammar)) {
+    engine = SME_PCRE;
+  } else if (get_matcher_program(grammar)) {
+    engine = SME_NFA;
+  } else {
+    engine = SME_PCRE;
+  }
+
+  switch_mutex_lock(grammar->mutex);
+  if (!is_published(grammar, GA_ENGINE)) {
+    grammar->selected_engine = engine;
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "selected engine %i for %.0f positions, %i symbols, %i tags\n",
+        engine, positions, shape.alphabet_size, grammar->tag_count);
+    }
+    publish(grammar, GA_ENGINE);
+  }
+  switch_mutex_unlock(grammar->mutex);
+  return grammar->selected_engine;
+}
+
+/**
+ * @param grammar the grammar
+ * @return the engine to match the grammar with, picked now if SME_AUTO
+ *         was selected and no engine has been picked yet
+ */
+static enum srgs_match_engine match_engine(struct srgs_grammar *grammar)
+{
+  enum srgs_match_engine engine;
+  if (!grammar) {
+    return SME_PCRE;
+  }
+  engine = __atomic_load_n(&grammar->engine, __ATOMIC_RELAXED);
+  return engine == SME_AUTO ? select_engine(grammar) : engine;
+}
+
+/**
+ * Log the rules that reference each other in a loop
+ * @param grammar the grammar
+ * @param rules the rules being resolved, outermost first
+ * @param rule the rule referenced again
+ */
+static void log_rule_loop(struct srgs_grammar *grammar, const std::vector<struct srgs_node *> &rules, struct srgs_node *rule)
+{
+  std::stringstream loop;
+  size_t i = 0;
+  while (i < rules.size() && rules[i] != rule) {
+    i++;
+  }
+  for (; i < rules.size(); i++) {
+    loop << rules[i]->value.rule.id << " -> ";
+  }
+  loop << rule->value.rule.id;
+  if(globals.logging_callback) {
+    globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Loop detected: %s\n", loop.str().c_str());
+  }
+}
+
+/**
+ * Resolve all unresolved references and detect loops.  This is a
+ * depth first walk of the rule reference graph: each node is resolved
+ * once, and a loop is found when a rule still being resolved is
+ * referenced again.
+ * @param grammar the grammar
+ * @param node the current node
+ * @param level the recursion level
+ * @param rules the rules being resolved, outermost first
+ * @return 1 if successful
+ */
+static int resolve_refs(struct srgs_grammar *grammar, struct srgs_node *node, int level, std::vector<struct srgs_node *> &rules)
+{
+  if (node->resolve_state == RS_RESOLVED) {
+    return 1;
+  }
+  if (node->resolve_state == RS_RESOLVING) {
+    if (node->type == SNT_RULE) {
+      log_rule_loop(grammar, rules, node);
+    } else if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Loop detected.\n");
+    }
+    return 0;
+  }
+  sn_log_node_open(node);
+  node->resolve_state = RS_RESOLVING;
+
+  if (level > MAX_RECURSION) {
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Recursion too deep.\n");
+    }
+    return 0;
+  }
+
+  if (node->type == SNT_GRAMMAR && node->value.root) {
+    struct srgs_node *rule = (struct srgs_node *)grammar->rules[node->value.root];
+    if (!rule) {
+      if(globals.logging_callback) {
+        globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Root rule not found: %s\n", node->value.root);
+      }
+      return 0;
+    }
+    grammar->root_rule = rule;
+  }
+
+  if (node->type == SNT_UNRESOLVED_REF) {
+    /* resolve reference to local rule- drop first character # from URI */
+    struct srgs_node *rule = (struct srgs_node *)grammar->rules[node->value.ref.uri + 1];
+    if (!rule) {
+      if(globals.logging_callback) {
+        globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Local rule not found: %s\n", node->value.ref.uri);
+      }
+      return 0;
+    }
+
+    /* link to rule */
+    node->type = SNT_REF;
+    node->value.ref.node = rule;
+  }
+
+  if (node->type == SNT_RULE) {
+    rules.push_back(node);
+  }
+
+  /* travel through rule to detect loops */
+  if (node->type == SNT_REF) {
+    if (!resolve_refs(grammar, node->value.ref.node, level + 1, rules)) {
+      return 0;
+    }
+  }
+
+  /* resolve children refs */
+  if (node->child) {
+    struct srgs_node *child = node->child;
+    for (; child; child = child->next) {
+      if (!resolve_refs(grammar, child, level + 1, rules)) {
+        return 0;
+      }
+    }
+  }
+
+  if (node->type == SNT_RULE) {
+    rules.pop_back();
+  }
+  node->resolve_state = RS_RESOLVED;
+  sn_log_node_close(node);
+  return 1;
+}
+
+/**
+ * @param node the node to check
+ * @return true if node is an <item> that matches its children once without a <tag>
+ */
+static int sn_is_plain_item(struct srgs_node *node)
+{
+  return node->type == SNT_ITEM && !node->value.item.tag && node->value.item.repeat_min == 1 && node->value.item.repeat_max == 1;
+}
+
+/**
+ * @param node the node to check
+ * @return true if node is an <item> without a <tag> that matches no input
+ */
+static int sn_is_empty_item(struct srgs_node *node)
+{
+  struct srgs_node *child;
+  if (node->type != SNT_ITEM || node->value.item.tag) {
+    return 0;
+  }
+  for (child = node->child; child; child = child->next) {
+    switch (child->type) {
+      case SNT_ONE_OF:
+      case SNT_ITEM:
+      case SNT_REF:
+      case SNT_STRING:
+        return 0;
+      default:
+        break;
+    }
+  }
+  return 1;
+}
+
+/**
+ * Replace the children of a node
+ * @param node the parent node
+ * @param children the new children, in order
+ */
+static void sn_set_children(struct srgs_node *node, const std::vector<struct srgs_node *> &children)
+{
+  size_t i;
+  node->child = NULL;
+  node->last_child = NULL;
+  node->num_children = 0;
+  for (i = 0; i < children.size(); i++) {
+    struct srgs_node *child = children[i];
+    child->parent = node;
+    child->next = NULL;
+    if (node->last_child) {
+      node->last_child->next = child;
+    } else {
+      node->child = child;
+    }
+    node->last_child = child;
+    node->num_children++;
+  }
+}
+
+/**
+ * Simplify the children of a <rule> or <item>, which are matched in sequence.
+ * Single alternative <one-of>s and plain <item>s are replaced by their
+ * contents, empty <item>s are dropped and adjacent DTMF strings are merged.
+ * @param grammar the grammar
+ * @param node the <rule> or <item>
+ */
+static void simplify_sequence(struct srgs_grammar *grammar, struct srgs_node *node)
+{
+  std::vector<struct srgs_node *> children;
+  std::vector<struct srgs_node *> merged;
+  struct srgs_node *child;
+  size_t i;
+
+  for (child = node->child; child; child = child->next) {
+    struct srgs_node *content = child;
+    if (content->type == SNT_ONE_OF && content->num_children == 1) {
+      content = content->child;
+    }
+    if (sn_is_plain_item(content)) {
+      for (content = content->child; content; content = content->next) {
+        children.push_back(content);
+      }
+    } else {
+      children.push_back(content);
+    }
+  }
+
+  for (i = 0; i < children.size(); i++) {
+    child = children[i];
+    if (sn_is_empty_item(child) && merged.size() + children.size() - i > 1) {
+      /* keep at least one child so the node still emits something */
+      continue;
+    }
+    if (grammar->digit_mode && child->type == SNT_STRING && !merged.empty() && merged.back()->type == SNT_STRING) {
+      struct srgs_node *prev = merged.back();
+      prev->value.string = switch_core_sprintf(grammar->pool, "%s%s", prev->value.string, child->value.string);
+      continue;
+    }
+    merged.push_back(child);
+  }
+  sn_set_children(node, merged);
+}
+
+/**
+ * Simplify the alternatives of a <one-of>.  An alternative that is a
+ * plain <item> around another <one-of> is replaced by that <one-of>'s
+ * alternatives, which keeps the order alternatives are tried in.
+ * @param node the <one-of>
+ */
+static void simplify_alternatives(struct srgs_node *node)
+{
+  std::vector<struct srgs_node *> children;
+  struct srgs_node *child;
+
+  for (child = node->child; child; child = child->next) {
+    if (sn_is_plain_item(child) && child->num_children == 1 && child->child->type == SNT_ONE_OF) {
+      struct srgs_node *alternative;
+      for (alternative = child->child->child; alternative; alternative = alternative->next) {
+        children.push_back(alternative);
+      }
+    } else {
+      children.push_back(child);
+    }
+  }
+  sn_set_children(node, children);
+}
+
+/**
+ * Rewrite the resolved parse tree into an equivalent smaller one before
+ * it is converted to regex, JSGF or a DFA.  <item>s with <tag>s are kept
+ * so the interpretation does not change.  Referenced rules are simplified
+ * where they are defined.
+ * @param grammar the grammar
+ * @param node the node to simplify
+ */
+static void simplify(struct srgs_grammar *grammar, struct srgs_node *node)
+{
+  struct srgs_node *child;
+
+  for (child = node->child; child; child = child->next) {
+    simplify(grammar, child);
+  }
+
+  switch (node->type) {
+    case SNT_STRING:
+      if (node->child && node->child->type == SNT_STRING) {
+        /* DTMF digits are parsed as a chain of single digit strings */
+        node->value.string = switch_core_sprintf(grammar->pool, "%s%s", node->value.string, node->child->value.string);
+        sn_set_children(node, std::vector<struct srgs_node *>());
+      }
+      break;
+    case SNT_RULE:
+    case SNT_ITEM:
+      simplify_sequence(grammar, node);
+      break;
+    case SNT_ONE_OF:
+      simplify_alternatives(node);
+      break;
+    default:
+      break;
+  }
+}
+
+/**
+ * Build what the first match needs so it doesn't wait for it
+ * @param grammar the grammar
+ * @return true if the grammar can be matched
+ */
+static int compile_matcher(struct srgs_grammar *grammar)
+{
+  enum srgs_match_engine engine = match_engine(grammar);
+  if (engine == SME_NFA && get_matcher_program(grammar)) {
+    return 1;
+  }
+  if (engine == SME_GLUSHKOV && get_compiled_glushkov(grammar) && (!grammar->tag_count || get_matcher_program(grammar))) {
+    return 1;
+  }
+  /* PCRE matches also use the DFA to tell if more input can follow */
+  if (get_compiled_dfa(grammar) && engine == SME_DFA) {
+    return 1;
+  }
+  if (!get_compiled_regex(grammar)) {
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_INFO, "Failed to compile grammar\n");
+    }
+    return 0;
+  }
+  return 1;
+}
+
+/**
+ * Build the optimized matchers of queued grammars
+ * @param data unused
+ * @return NULL
+ */
+static void *upgrade_run(void *data)
+{
+  switch_mutex_lock(upgrades.mutex);
+  for (;;) {
+    struct srgs_grammar *grammar;
+    while ((upgrades.grammars.empty() || upgrades.paused) && !upgrades.stopped) {
+      switch_thread_cond_wait(upgrades.queued, upgrades.mutex);
+    }
+    if (upgrades.stopped) {
+      break;
+    }
+    grammar = upgrades.grammars.front();
+    upgrades.grammars.pop_front();
+    switch_mutex_unlock(upgrades.mutex);
+
+    compile_matcher(grammar);
+    publish(grammar, GA_UPGRADED);
+    if(globals.logging_callback) {
+      globals.logging_callback(grammar, CSPEECH_LOG_DEBUG, "grammar upgraded\n");
+    }
+    srgs_grammar_unref(grammar);
+
+    switch_mutex_lock(upgrades.mutex);
+  }
+  switch_mutex_unlock(upgrades.mutex);
+  return NULL;
+}
+
+/**
+ * Queue a grammar for its optimized matchers to be built in the background
+ * @param grammar the grammar
+ * @return true if queued
+ */
+static int upgrade_later(struct srgs_grammar *grammar)
+{
+  switch_mutex_lock(upgrades.mutex);
+  if (upgrades.stopped) {
+    /* compiled on first match instead */
+    switch_mutex_unlock(upgrades.mutex);
+    return 0;
+  }
+  if (!upgrades.started) {
+    upgrades.started = !pthread_create(&upgrades.thread, NULL, upgrade_run, NULL);
+    if (!upgrades.started) {
+      switch_mutex_unlock(upgrades.mutex);
+      if(globals.logging_callback) {
+        globals.logging_callback(grammar, CSPEECH_LOG_WARNING, "Failed to start grammar compiler thread\n");
+      }
+      return 0;
+    }
+  }
+  upgrades.grammars.push_back(srgs_grammar_ref(grammar));
+  switch_thread_cond_signal(upgrades.queued);
+  switch_mutex_unlock(upgrades.mutex);
+  return 1;
+}
+
+/**
+ * Parse a document that is not in the cache
+ * @param parser the parser
+ * @param document the document to parse
+ * @param options grammar_option bits to build the grammar with
+ * @return the parsed grammar if successful
+ */
+static struct srgs_grammar *parse_document(struct srgs_parser *parser, const char *document, int options)
+{
+  struct srgs_grammar *grammar;
+  int result = 0;
+  iksparser *p;
+  std::vector<struct srgs_node *> rules;
+  if(globals.logging_callback) {
+    globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Parsing new grammar\n");
+  }
+  grammar = srgs_grammar_new(parser, options);
+  p = iks_sax_new(grammar, tag_hook, cdata_hook);
+  if (iks_parse(p, document, 0, 1) == IKS_OK) {
+    if (grammar->root) {
+      if(globals.logging_callback) {
+        globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Resolving references\n");
+      }
+      if (resolve_refs(grammar, grammar->root, 0, rules)) {
+        simplify(grammar, grammar->root);
+        /* failures aren't cached, so a grammar that can't be matched is parsed again next time */
+        result = !parser->eager_compile || compile_matcher(grammar);
+        if (result && (options & GO_TIERED_COMPILE) && get_matcher_program(grammar)) {
+          grammar->tiered = upgrade_later(grammar);
+        }
+      }
+    } else {
+      if(globals.logging_callback) {
+        globals.logging_callback(parser, CSPEECH_LOG_INFO, "Nothing to parse!\n");
+      }
+    }
+  }
+  iks_parser_delete(p);
+  if (!result) {
+    if (grammar) {
+      srgs_grammar_destroy(grammar);
+      grammar = NULL;
+    }
+    if(globals.logging_callback) {
+      globals.logging_callback(parser, CSPEECH_LOG_INFO, "Failed to parse grammar\n");
+    }
+  }
+  return grammar;
+}
+
+/**
+ * Parse the document into rules to match.  Grammars are shared by all
+ * parsers through the process-wide cache.  A cache shard is only locked
+ * to look up and update entries, so cached grammars are returned while
+ * other documents are being parsed.  Callers asking for a document that
+ * is already being parsed wait for that parse to finish.
+ * @param parser the parser
+ * @param document the document to parse
+ * @return the parsed grammar if successful.  It is valid until the parser
+ *         is destroyed, callers keeping it longer take a reference with
+ *         srgs_grammar_ref().
+ */
+struct srgs_grammar *srgs_parse(struct srgs_parser *parser, const char *document)
+{
+  struct srgs_grammar *grammar = NULL;
+  struct grammar_cache_entry *entry;
+  struct grammar_cache_shard *shard;
+  char key[FINGERPRINT_SIZE + 1];
+  std::string normalized;
+  int options;
+  if (!parser) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "NULL parser!!\n");
+    }
+    return NULL;
+  }
+
+  if (cspeech_zstr(document)) {
+    if(globals.logging_callback) {
+      globals.logging_callback(parser, CSPEECH_LOG_INFO, "Missing grammar document\n");
+    }
+    return NULL;
+  }
+
+  /* read the options once, so the grammar is built with the options it is cached under */
+  options = grammar_options(parser);
+  normalize_document(document, normalized);
+  shard = &cache.shards[document_fingerprint(normalized, options, key) % CACHE_SHARDS];
+
+  /* check for cached grammar */
+  switch_mutex_lock(shard->mutex);
+  entry = (struct grammar_cache_entry *)switch_core_hash_find(shard->entries, key);
+  if (entry && (entry->options != options || strcmp(entry->document, normalized.c_str()))) {
+    /* a different document with the same fingerprint, don't cache this one */
+    if(globals.logging_callback) {
+      globals.logging_callback(parser, CSPEECH_LOG_WARNING, "Grammar fingerprint %s collides, parsing without cache\n", key);
+    }
+    shard->stats.misses++;
+    switch_mutex_unlock(shard->mutex);
+    grammar = parse_document(parser, document, options);
+  } else if (!entry) {
+    unsigned long keep = 0;
+    int i;
+
+    /* claim the document so concurrent callers wait for this parse */
+    shard->stats.misses++;
+    entry = (struct grammar_cache_entry *)calloc(1, sizeof(*entry) + normalized.size() + 1);
+    strcpy(entry->key, key);
+    entry->document = (char *)(entry + 1);
+    memcpy(entry->document, normalized.c_str(), normalized.size() + 1);
+    entry->options = options;
+    entry->state = GCS_PARSING;
+    switch_core_hash_insert(shard->entries, entry->key, entry);
+    switch_mutex_unlock(shard->mutex);
+
+    if ((grammar = parse_document(parser, document, options))) {
+      grammar_add_size(grammar, srgs_grammar_size(grammar, normalized.size()));
+    }
+
+    switch_mutex_lock(shard->mutex);
+    entry->grammar = grammar;
+    if (grammar) {
+      /* waiters each get a reference, the cache keeps one */
+      for (i = 0; i <= entry->waiters; i++) {
+        srgs_grammar_ref(grammar);
+      }
+      entry->state = GCS_PARSED;
+      __atomic_add_fetch(&cache.entries, 1, __ATOMIC_RELAXED);
+      cache_add_size(grammar);
+      cache_push(shard, entry);
+      keep = entry->used;
+    } else {
+      /* don't cache failures, let the next caller try again */
+      entry->state = GCS_FAILED;
+      switch_core_hash_delete(shard->entries, entry->key);
+      if (!entry->waiters) {
+        free(entry);
+      }
+    }
+    switch_thread_cond_broadcast(shard->parsed);
+    switch_mutex_unlock(shard->mutex);
+    if (keep) {
+      /* make room for the new grammar, not by evicting it */
+      cache_trim(keep);
+    }
+  } else if (entry->state == GCS_PARSING) {
+    if(globals.logging_callback) {
+      globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Waiting for grammar to be parsed\n");
+    }
+    shard->stats.hits++;
+    entry->waiters++;
+    while (entry->state == GCS_PARSING) {
+      switch_thread_cond_wait(shard->parsed, shard->mutex);
+    }
+    entry->waiters--;
+    grammar = entry->grammar;
+    if (entry->state != GCS_PARSED && !entry->waiters) {
+      /* no longer cached and nobody else is looking at it */
+      free(entry);
+    }
+    switch_mutex_unlock(shard->mutex);
+  } else {
+    if(globals.logging_callback) {
+      globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Using cached grammar\n");
+    }
+    shard->stats.hits++;
+    grammar = srgs_grammar_ref(entry->grammar);
+    cache_touch(shard, entry);
+    switch_mutex_unlock(shard->mutex);
+  }
+
+  /* cached grammar may have been parsed without eager compilation */
+  if (grammar && parser->eager_compile && !compile_matcher(grammar)) {
+    srgs_grammar_unref(grammar);
+    grammar = NULL;
+  }
+
+  if (grammar) {
+    /* the parser keeps one reference per grammar until it is destroyed */
+    switch_mutex_lock(parser->mutex);
+    if (!parser->grammars->insert(grammar).second) {
+      srgs_grammar_unref(grammar);
+    }
+    switch_mutex_unlock(parser->mutex);
+  }
+  return grammar;
+}
+
+#define OVECTOR_SIZE ((MAX_REGEX_TAGS + 1) * 3)
+#define WORKSPACE_SIZE 1024
+#define MATCH_BATCH_CHUNK 256
+#define MAX_MATCH_BATCH_THREADS 64
+
+/**
+ * Run compiled grammar regex against input.  JIT code is skipped
+ * if it has been switched off since the regex was studied.
+ * @param grammar the grammar with a compiled regex
+ * @param input the input to match
+ * @param input_size length of input
+ * @param options pcre_exec() options
+ * @param ovector the output vector, OVECTOR_SIZE long
+ * @return the pcre_exec() result
+ */
+static int regex_exec(struct srgs_grammar *grammar, const char *input, int input_size, int options, int *ovector)
+{
+  pcre_extra *extra = grammar->extra;
+#ifdef PCRE_STUDY_JIT_COMPILE
+  pcre_extra interpreted;
+  if (extra && !globals.jit && (extra->flags & PCRE_EXTRA_EXECUTABLE_JIT)) {
+    interpreted = *extra;
+    interpreted.flags &= ~PCRE_EXTRA_EXECUTABLE_JIT;
+    extra = &interpreted;
+  }
+#endif
+  return pcre_exec(grammar->compiled_regex, extra, input, input_size, 0, options, ovector, OVECTOR_SIZE);
+}
+
+/**
+ * Incremental match of digits against a grammar
+ */
+struct srgs_match_session {
+  /** the grammar to match */
+  struct srgs_grammar *grammar;
+  /** compiled grammar, NULL if the program or PCRE must be used */
+  struct fsm_dfa *dfa;
+  /** DFA state reached by input */
+  int state;
+  /** program simulation if there is no DFA, NULL if PCRE must be used */
+  struct fsm_stream *stream;
+  /** input so far, only kept if PCRE must be used */
+  char *input;
+  /** length of input */
+  size_t input_len;
+  /** size of input buffer */
+  size_t input_size;
+  /** match result of input */
+  enum srgs_match_type result;
+  /** interpretation of input */
+  const char *interpretation;
+};
+
+/**
+ * Check if no more digits can be added to input and match by probing
+ * each DTMF symbol.  Only used when the grammar has no DFA.
+ * @param grammar the grammar with a compiled regex
+ * @param input the input to check
+ * @return true if end of match (no more input can be added)
+ */
+static int is_match_end(struct srgs_grammar *grammar, const char *input)
+{
+  int ovector[OVECTOR_SIZE];
+  int input_size = strlen(input);
+  std::string search_input(input);
+  const char *search_set = SRGS_DTMF_SYMBOLS;
+  const char *search = strchr(search_set, input[input_size - 1]); /* start with last digit in input */
+  int i = 0;
+
+  if (!search) {
+    search = search_set;
+  }
+
+  /* For each digit in search_set, check if input + search_set digit is a potential match.
+     If so, then this is not a match end.
+   */
+  search_input.push_back('Z');
+  for (i = 0; i < 16; i++) {
+    int result;
+    if (!*search) {
+      search = search_set;
+    }
+    search_input[input_size] = *search++;
+    result = regex_exec(grammar, search_input.data(), input_size + 1, 0, ovector);
+    if (result >= 0) {
+      if(globals.logging_callback) {
+        globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "not match end\n");
+      }
+      return 0;
+    }
+  }
+  if(globals.logging_callback) {
+    globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "is match end\n");
+  }
+  return 1;
+}
+
+/**
+ * Get the match result of a DFA state
+ * @param grammar the grammar being matched
+ * @param dfa the compiled grammar
+ * @param state the state reached by the input
+ * @param interpretation the (optional) interpretation of the input result
+ * @return the match result
+ */
+static enum srgs_match_type dfa_state_result(struct srgs_grammar *grammar, struct fsm_dfa *dfa, int state, const char **interpretation)
+{
+  if(globals.logging_callback) {
+    globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "dfa state = %i\n", state);
+  }
+  if (state == FSM_DEAD_STATE) {
+    return SMT_NO_MATCH;
+  }
+  if (!dfa->accept[state]) {
+    return SMT_MATCH_PARTIAL;
+  }
+  if (dfa->tag[state]) {
+    *interpretation = grammar->tags[dfa->tag[state]];
+  }
+  if (dfa->match_end[state]) {
+    return SMT_MATCH_END;
+  }
+  return SMT_MATCH;
+}
+
+/**
+ * Get the match result of a program simulation
+ * @param grammar the grammar being matched
+ * @param stream the simulation
+ * @param live true if the input so far can still match
+ * @param interpretation the (optional) interpretation of the input result
+ * @return the match result
+ */
+static enum srgs_match_type stream_result(struct srgs_grammar *grammar, struct fsm_stream *stream, int live, const char **interpretation)
+{
+  struct fsm_capture capture;
+  int i;
+  if (!live) {
+    return SMT_NO_MATCH;
+  }
+  if (!fsm_stream_result(stream, &capture)) {
+    return SMT_MATCH_PARTIAL;
+  }
+  if (capture.tag) {
+    *interpretation = grammar->tags[capture.tag];
+  }
+  for (i = 0; SRGS_DTMF_SYMBOLS[i]; i++) {
+    if (fsm_stream_accepts_after(stream, SRGS_DTMF_SYMBOLS[i])) {
+      return SMT_MATCH;
+    }
+  }
+  return SMT_MATCH_END;
+}
+
+/**
+ * @param stream the program simulation
+ * @return bit i set if SRGS_DTMF_SYMBOLS[i] may follow the input so far
+ */
+static unsigned int stream_next_symbols(struct fsm_stream *stream)
+{
+  unsigned int symbols = 0;
+  int i;
+  for (i = 0; SRGS_DTMF_SYMBOLS[i]; i++) {
+    if (fsm_stream_can_step(stream, SRGS_DTMF_SYMBOLS[i])) {
+      symbols |= 1 << i;
+    }
+  }
+  return symbols;
+}
+
+/**
+ * Match input by simulating the grammar program
+ * @param grammar the grammar to match, with a program
+ * @param stream scratch simulation of the program, NULL to create one
+ * @param input the input to compare
+ * @param interpretation set to the interpretation of the input result
+ * @return the match result
+ */
+static enum srgs_match_type program_match(struct srgs_grammar *grammar, struct fsm_stream *stream, const char *input, struct srgs_interpretation *interpretation)
+{
+  struct fsm_stream *scratch = stream ? NULL : fsm_stream_create(grammar->program);
+  struct fsm_capture capture;
+  enum srgs_match_type match;
+  if (stream) {
+    fsm_stream_reset(stream);
+  } else {
+    stream = scratch;
+  }
+  match = stream_result(grammar, stream, fsm_stream_feed(stream, input, strlen(input)), &interpretation->tag);
+  if (interpretation->tag && fsm_stream_result(stream, &capture)) {
+    interpretation->offset = capture.offset;
+    interpretation->length = capture.length;
+  }
+  if (scratch) {
+    fsm_stream_destroy(scratch);
+  }
+  return match;
+}
+
+/**
+ * Find where the <tag>ged item of input matched by simulating the grammar program
+ * @param grammar the grammar, with a program
+ * @param stream scratch simulation of the program, NULL to use a new one
+ * @param input the input
+ * @param capture set to the interpretation of the input
+ * @return true if input matched
+ */
+static int program_capture(struct srgs_grammar *grammar, struct fsm_stream *stream, const char *input, struct fsm_capture *capture)
+{
+  if (!stream) {
+    return fsm_program_match(grammar->program, input, capture);
+  }
+  fsm_stream_reset(stream);
+  return fsm_stream_feed(stream, input, strlen(input)) && fsm_stream_result(stream, capture);
+}
+
+/**
+ * Match input with the grammar DFA
+ * @param grammar the grammar to match
+ * @param dfa the grammar DFA
+ * @param state the DFA state reached by input
+ * @param input the input to compare
+ * @param interpretation set to the interpretation of the input result
+ * @param find_span true if the input matched by the interpretation is needed
+ * @param stream scratch simulation of the program, NULL to use a new one
+ * @return the match result
+ */
+static enum srgs_match_type dfa_match(struct srgs_grammar *grammar, struct fsm_dfa *dfa, int state, const char *input, struct srgs_interpretation *interpretation, int find_span, struct fsm_stream *stream)
+{
+  enum srgs_match_type match = dfa_state_result(grammar, dfa, state, &interpretation->tag);
+  if (find_span && interpretation->tag) {
+    /* DFA doesn't know where the input matched, simulate the program to find out */
+    struct fsm_capture capture;
+    if (program_capture(grammar, stream, input, &capture)) {
+      interpretation->offset = capture.offset;
+      interpretation->length = capture.length;
+    }
+  }
+  return match;
+}
+
+/**
+ * Find the interpretation of input matched by a regex without <tag> captures
+ * @param grammar the grammar to match
+ * @param dfa the grammar DFA, NULL if none
+ * @param input the matched input
+ * @param interpretation set to the interpretation of the input
+ * @param find_span true if the input matched by the interpretation is needed
+ * @param stream scratch simulation of the program, NULL to use a new one
+ */
+static void program_interpretation(struct srgs_grammar *grammar, struct fsm_dfa *dfa, const char *input, struct srgs_interpretation *interpretation, int find_span, struct fsm_stream *stream)
+{
+  struct fsm_capture capture;
+  if (dfa && !find_span) {
+    int tag = dfa->tag[fsm_dfa_run(dfa, input)];
+    if (tag) {
+      interpretation->tag = grammar->tags[tag];
+    }
+  } else if (grammar->program && program_capture(grammar, stream, input, &capture) && capture.tag) {
+    interpretation->tag = grammar->tags[capture.tag];
+    interpretation->offset = capture.offset;
+    interpretation->length = capture.length;
+  }
+}
+
+/**
+ * Match input with the grammar Glushkov automaton
+ * @param grammar the grammar to match
+ * @param glushkov the grammar Glushkov automaton
+ * @param input the input to compare
+ * @param interpretation set to the interpretation of the input result
+ * @param stream scratch simulation of the program, NULL to use a new one
+ * @return the match result
+ */
+static enum srgs_match_type glushkov_match(struct srgs_grammar *grammar, struct fsm_glushkov *glushkov, const char *input, struct srgs_interpretation *interpretation, struct fsm_stream *stream)
+{
+  uint64_t set[FSM_GLUSHKOV_MAX_WORDS];
+  int match_end;
+  fsm_glushkov_start(glushkov, set);
+  if (!fsm_glushkov_feed(glushkov, set, input, strlen(input))) {
+    return SMT_NO_MATCH;
+  }
+  if (!fsm_glushkov_accepts(glushkov, set)) {
+    return SMT_MATCH_PARTIAL;
+  }
+  if (grammar->tag_count && get_matcher_program(grammar)) {
+    /* positions don't know which alternative PCRE would prefer, simulate the program to find out */
+    program_interpretation(grammar, NULL, input, interpretation, 1, stream);
+  }
+  fsm_glushkov_next_symbols(glushkov, set, &match_end);
+  return match_end ? SMT_MATCH_END : SMT_MATCH;
+}
+
+/**
+ * Match input with the compiled grammar regex
+ * @param grammar the grammar to match, with a compiled regex
+ * @param input the input to compare
+ * @param input_size length of input
+ * @param interpretation set to the interpretation of the input result
+ * @param find_span true if the input matched by the interpretation is needed
+ * @return the match result
+ */
+static enum srgs_match_type regex_match(struct srgs_grammar *grammar, const char *input, int input_size, struct srgs_interpretation *interpretation, int find_span)
+{
+  int ovector[OVECTOR_SIZE];
+  struct fsm_dfa *dfa;
+  int result = regex_exec(grammar, input, input_size, PCRE_PARTIAL, ovector);
+
+  if(globals.logging_callback) {
+    globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "match = %i\n", result);
+  }
+  if (result >= 0) {
+    int tag = 0;
+    int i;
+
+    /* 0 means the ovector is full, the captures that fit are still set */
+    if (result == 0) {
+      result = OVECTOR_SIZE / 3;
+    }
+
+    /* find matching instance - lowest numbered non-empty <tag> wins */
+    for (i = 1; i < result && grammar->capture_tags; i++) {
+      int capture_tag = grammar->capture_tags[i];
+      if (capture_tag && ovector[2 * i + 1] > ovector[2 * i] && (!tag || capture_tag < tag)) {
+        tag = capture_tag;
+        interpretation->offset = ovector[2 * i];
+        interpretation->length = ovector[2 * i + 1] - ovector[2 * i];
+      }
+    }
+    if (tag) {
+      interpretation->tag = grammar->tags[tag];
+    }
+
+    dfa = get_compiled_dfa(grammar);
+    if (!regex_has_tags(grammar)) {
+      program_interpretation(grammar, dfa, input, interpretation, find_span, NULL);
+    }
+    if (dfa) {
+      if (dfa->match_end[fsm_dfa_run(dfa, input)]) {
+        return SMT_MATCH_END;
+      }
+    } else if (is_match_end(grammar, input)) {
+      return SMT_MATCH_END;
+    }
+    return SMT_MATCH;
+  }
+  if (result == PCRE_ERROR_PARTIAL) {
+    return SMT_MATCH_PARTIAL;
+  }
+
+  return SMT_NO_MATCH;
+}
+
+/**
+ * Find a match
+ * @param grammar the grammar to match
+ * @param input the input to compare
+ * @param interpretation set to the interpretation of the input result
+ * @param find_span true if the input matched by the interpretation is needed
+ * @return the match result
+ */
+static enum srgs_match_type grammar_match(struct srgs_grammar *grammar, const char *input, struct srgs_interpretation *interpretation, int find_span)
+{
+  enum srgs_match_engine engine;
+  struct fsm_dfa *dfa;
+  struct fsm_glushkov *glushkov;
+
+  interpretation->tag = NULL;
+  interpretation->offset = 0;
+  interpretation->length = 0;
+
+  if (cspeech_zstr(input)) {
+    return SMT_NO_MATCH;
+  }
+
+  if (grammar && is_upgrading(grammar)) {
+    /* don't wait for the optimized matchers */
+    return program_match(grammar, NULL, input, interpretation);
+  }
+  engine = match_engine(grammar);
+  if (grammar && engine == SME_NFA && get_matcher_program(grammar)) {
+    return program_match(grammar, NULL, input, interpretation);
+  }
+  if (grammar && engine == SME_DFA && (dfa = get_compiled_dfa(grammar))) {
+    return dfa_match(grammar, dfa, fsm_dfa_run(dfa, input), input, interpretation, find_span, NULL);
+  }
+  if (grammar && engine == SME_GLUSHKOV && (glushkov = get_compiled_glushkov(grammar))) {
+    return glushkov_match(grammar, glushkov, input, interpretation, NULL);
+  }
+
+  if (!get_compiled_regex(grammar)) {
+    return SMT_NO_MATCH;
+  }
+  return regex_match(grammar, input, strlen(input), interpretation, find_span);
+}
+
+/**
+ * Find a match
+ * @param grammar the grammar to match
+ * @param input the input to compare
+ * @param interpretation the (optional) interpretation of the input result
+ * @return the match result
+ */
+enum srgs_match_type srgs_grammar_match(struct srgs_grammar *grammar, const char *input, const char **interpretation)
+{
+  struct srgs_interpretation result;
+  enum srgs_match_type match = grammar_match(grammar, input, &result, 0);
+  *interpretation = result.tag;
+  return match;
+}
+
+/**
+ * Find a match and where in the input the interpretation matched
+ * @param grammar the grammar to match
+ * @param input the input to compare
+ * @param interpretation set to the interpretation of the input result
+ * @return the match result
+ */
+enum srgs_match_type srgs_grammar_match_interpretation(struct srgs_grammar *grammar, const char *input, struct srgs_interpretation *interpretation)
+{
+  return grammar_match(grammar, input, interpretation, 1);
+}
+
+/**
+ * Inputs matched against a grammar by several threads
+ */
+struct match_batch {
+  /** the grammar to match */
+  struct srgs_grammar *grammar;
+  /** the grammar DFA, NULL if the regex or program is used */
+  struct fsm_dfa *dfa;
+  /** the grammar Glushkov automaton, NULL if not used */
+  struct fsm_glushkov *glushkov;
+  /** true if the program is simulated */
+  int simulate;
+  /** the inputs */
+  const char **inputs;
+  /** the results, one per input */
+  struct srgs_match_result *results;
+  /** number of inputs */
+  int num_inputs;
+  /** first input not yet claimed by a thread */
+  int next;
+};
+
+/**
+ * Match inputs from the batch until none are left
+ * @param data the batch
+ * @return NULL
+ */
+static void *match_batch_run(void *data)
+{
+  struct match_batch *batch = (struct match_batch *)data;
+  /* one simulation for every input that needs the program */
+  struct fsm_stream *stream = is_published(batch->grammar, GA_PROGRAM) && batch->grammar->program ? fsm_stream_create(batch->grammar->program) : NULL;
+  int first;
+  int states[MATCH_BATCH_CHUNK];
+  while ((first = __atomic_fetch_add(&batch->next, MATCH_BATCH_CHUNK, __ATOMIC_RELAXED)) < batch->num_inputs) {
+    int last = first + MATCH_BATCH_CHUNK < batch->num_inputs ? first + MATCH_BATCH_CHUNK : batch->num_inputs;
+    int i;
+    if (batch->dfa) {
+      /* step the whole chunk through the DFA together */
+      fsm_dfa_run_many(batch->dfa, batch->inputs + first, last - first, states);
+    }
+    for (i = first; i < last; i++) {
+      const char *input = batch->inputs[i];
+      struct srgs_match_result *result = &batch->results[i];
+      result->interpretation.tag = NULL;
+      result->interpretation.offset = 0;
+      result->interpretation.length = 0;
+      if (!input || !*input) {
+        result->match = SMT_NO_MATCH;
+      } else if (batch->dfa) {
+        result->match = dfa_match(batch->grammar, batch->dfa, states[i - first], input, &result->interpretation, 1, stream);
+      } else if (batch->glushkov) {
+        result->match = glushkov_match(batch->grammar, batch->glushkov, input, &result->interpretation, stream);
+      } else if (batch->simulate) {
+        result->match = program_match(batch->grammar, stream, input, &result->interpretation);
+      } else {
+        result->match = regex_match(batch->grammar, input, strlen(input), &result->interpretation, 1);
+      }
+    }
+  }
+  if (stream) {
+    fsm_stream_destroy(stream);
+  }
+  return NULL;
+}
+
+/**
+ * Match many inputs against a grammar.  The grammar is compiled once for
+ * the whole batch instead of being checked for every input.  With the
+ * DFA engine, inputs can be stepped through the DFA together using vector
+ * instructions, see srgs_set_simd().
+ * @param grammar the grammar to match
+ * @param inputs the inputs to compare
+ * @param num_inputs the number of inputs
+ * @param results set to the match result and interpretation of each input
+ * @param num_threads the number of threads to share the batch between, including the caller
+ * @return 1 if successful
+ */
+int srgs_grammar_match_batch(struct srgs_grammar *grammar, const char **inputs, int num_inputs, struct srgs_match_result *results, int num_threads)
+{
+  struct match_batch batch;
+  std::vector<pthread_t> threads;
+  int i;
+
+  if (!grammar) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
+    }
+    return 0;
+  }
+  batch.grammar = grammar;
+  batch.dfa = NULL;
+  batch.glushkov = NULL;
+  batch.simulate = is_upgrading(grammar) || (match_engine(grammar) == SME_NFA && get_matcher_program(grammar));
+  if (!batch.simulate) {
+    batch.dfa = match_engine(grammar) == SME_DFA ? get_compiled_dfa(grammar) : NULL;
+    batch.glushkov = match_engine(grammar) == SME_GLUSHKOV ? get_compiled_glushkov(grammar) : NULL;
+    if (!batch.dfa && !batch.glushkov && !get_compiled_regex(grammar)) {
+      return 0;
+    }
+  }
+  batch.inputs = inputs;
+  batch.results = results;
+  batch.num_inputs = num_inputs;
+  batch.next = 0;
+
+  /* no point in threads that would have nothing to do */
+  if (num_threads > MAX_MATCH_BATCH_THREADS) {
+    num_threads = MAX_MATCH_BATCH_THREADS;
+  }
+  if (num_threads > (num_inputs + MATCH_BATCH_CHUNK - 1) / MATCH_BATCH_CHUNK) {
+    num_threads = (num_inputs + MATCH_BATCH_CHUNK - 1) / MATCH_BATCH_CHUNK;
+  }
+  for (i = 1; i < num_threads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, match_batch_run, &batch)) {
+      /* the threads already running will finish the batch */
+      break;
+    }
+    threads.push_back(thread);
+  }
+  match_batch_run(&batch);
+  for (i = 0; i < (int)threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+  return 1;
+}
+
+/**
+ * Find the DTMF symbols that can follow input without making it invalid
+ * @param grammar the grammar to match
+ * @param input the input so far, may be empty
+ * @return bit i set if SRGS_DTMF_SYMBOLS[i] may follow input
+ */
+unsigned int srgs_grammar_next_symbols(struct srgs_grammar *grammar, const char *input)
+{
+  unsigned int symbols = 0;
+  struct fsm_dfa *dfa;
+
+  if (!grammar) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
+    }
+    return 0;
+  }
+  if (!input) {
+    input = "";
+  }
+
+  if (is_upgrading(grammar)) {
+    /* don't wait for the optimized matchers */
+    struct fsm_stream *stream = fsm_stream_create(grammar->program);
+    if (fsm_stream_feed(stream, input, strlen(input))) {
+      symbols = stream_next_symbols(stream);
+    }
+    fsm_stream_destroy(stream);
+    return symbols;
+  }
+
+  if ((dfa = get_compiled_dfa(grammar))) {
+    return dfa->next_symbols[fsm_dfa_run(dfa, input)];
+  }
+
+  /* no DFA, probe each symbol */
+  if (get_compiled_regex(grammar)) {
+    int ovector[OVECTOR_SIZE];
+    int input_size = strlen(input);
+    std::string search_input(input);
+    int i;
+    search_input.push_back('\0');
+    for (i = 0; SRGS_DTMF_SYMBOLS[i]; i++) {
+      int result;
+      search_input[input_size] = SRGS_DTMF_SYMBOLS[i];
+      result = regex_exec(grammar, search_input.data(), input_size + 1, PCRE_PARTIAL, ovector);
+      if (result >= 0 || result == PCRE_ERROR_PARTIAL) {
+        symbols |= 1 << i;
+      }
+    }
+  }
+  return symbols;
+}
+
+/**
+ * Create a session for matching input that arrives one digit or chunk at
+ * a time.  The grammar's DFA is used if it can be compiled, so each
+ * digit costs a single transition.  Otherwise the matcher program is
+ * simulated as input arrives.  Either way no input is kept, so the session
+ * size doesn't depend on the input length.  The session keeps a reference to the grammar.
+ * @param grammar the grammar to match
+ * @return the session or NULL
+ */
+struct srgs_match_session *srgs_match_session_new(struct srgs_grammar *grammar)
+{
+  struct srgs_match_session *session;
+  if (!grammar) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
+    }
+    return NULL;
+  }
+  session = (struct srgs_match_session *)malloc(sizeof(*session));
+  session->grammar = srgs_grammar_ref(grammar);
+  /* a tiered grammar still being compiled is simulated for the whole session */
+  session->dfa = is_upgrading(grammar) ? NULL : get_compiled_dfa(grammar);
+  session->stream = !session->dfa && get_matcher_program(grammar) ? fsm_stream_create(grammar->program) : NULL;
+  session->input = NULL;
+  session->input_size = 0;
+  srgs_match_session_reset(session);
+  return session;
+}
+
+/**
+ * Discard all input
+ * @param session the session
+ */
+void srgs_match_session_reset(struct srgs_match_session *session)
+{
+  session->state = session->dfa ? session->dfa->start : FSM_DEAD_STATE;
+  if (session->stream) {
+    fsm_stream_reset(session->stream);
+  }
+  if (session->input) {
+    session->input[0] = '\0';
+  }
+  session->input_len = 0;
+  session->result = SMT_NO_MATCH;
+  session->interpretation = NULL;
+}
+
+/**
+ * Add a chunk of input.  Time is linear in the chunk length unless
+ * the grammar can only be matched with PCRE.
+ * @param session the session
+ * @param input the input
+ * @param len the input length
+ * @return the match result of all input so far
+ */
+enum srgs_match_type srgs_match_session_feed(struct srgs_match_session *session, const char *input, size_t len)
+{
+  session->interpretation = NULL;
+  if (session->dfa) {
+    size_t i;
+    for (i = 0; i < len && session->state != FSM_DEAD_STATE; i++) {
+      session->state = fsm_dfa_step(session->dfa, session->state, input[i]);
+    }
+    session->result = dfa_state_result(session->grammar, session->dfa, session->state, &session->interpretation);
+  } else if (session->stream) {
+    int live = fsm_stream_feed(session->stream, input, len);
+    session->result = stream_result(session->grammar, session->stream, live, &session->interpretation);
+  } else {
+    /* no matcher program, keep the input and match everything again */
+    if (session->input_len + len + 1 > session->input_size) {
+      session->input_size = (session->input_len + len + 1) * 2;
+      session->input = (char *)realloc(session->input, session->input_size);
+    }
+    memcpy(session->input + session->input_len, input, len);
+    session->input_len += len;
+    session->input[session->input_len] = '\0';
+    session->result = srgs_grammar_match(session->grammar, session->input, &session->interpretation);
+  }
+  return session->result;
+}
+
+/**
+ * Add a digit to the input
+ * @param session the session
+ * @param digit the digit
+ * @return the match result of all input so far
+ */
+enum srgs_match_type srgs_match_session_feed_digit(struct srgs_match_session *session, char digit)
+{
+  return srgs_match_session_feed(session, &digit, 1);
+}
+
+/**
+ * Get the match result of all input so far
+ * @param session the session
+ * @param interpretation the (optional) interpretation of the input result
+ * @return the match result
+ */
+enum srgs_match_type srgs_match_session_result(struct srgs_match_session *session, const char **interpretation)
+{
+  *interpretation = session->interpretation;
+  return session->result;
+}
+
+/**
+ * Find the DTMF symbols that can follow the session input
+ * @param session the session
+ * @return bit i set if SRGS_DTMF_SYMBOLS[i] may follow input
+ */
+unsigned int srgs_match_session_next_symbols(struct srgs_match_session *session)
+{
+  if (session->dfa) {
+    return session->dfa->next_symbols[session->state];
+  }
+  if (session->stream) {
+    return stream_next_symbols(session->stream);
+  }
+  return srgs_grammar_next_symbols(session->grammar, session->input);
+}
+
+/**
+ * Destroy the session
+ * @param session the session
+ */
+void srgs_match_session_destroy(struct srgs_match_session *session)
+{
+  srgs_grammar_unref(session->grammar);
+  if (session->stream) {
+    fsm_stream_destroy(session->stream);
+  }
+  free(session->input);
+  free(session);
+}
+
+/**
+ * Grammars that are matched together
+ */
+struct srgs_grammar_set {
+  /** number of grammars */
+  int num_grammars;
+  /** the grammars, in priority order */
+  struct srgs_grammar **grammars;
+  /** compiled grammars, NULL if PCRE must be used */
+  struct fsm_dfa **dfas;
+  /** product component of each grammar, -1 if it has no DFA */
+  int *components;
+  /** the DFAs combined, NULL if too big */
+  struct fsm_product *product;
+};
+
+/**
+ * Incremental match of digits against a grammar set
+ */
+struct srgs_grammar_set_session {
+  /** the grammars to match */
+  struct srgs_grammar_set *set;
+  /** product state reached by input */
+  int state;
+  /** DFA state of each grammar reached by input, used if there is no product */
+  int *states;
+  /** session of each grammar without a DFA, NULL for the others */
+  struct srgs_match_session **sessions;
+};
+
+/**
+ * Combine grammars so they can be matched together.  The DFAs of the
+ * grammars are merged into one so each digit costs a single transition
+ * for all of them.  Grammars are matched with their DFA whatever engine
+ * they are set to use.  The set keeps a reference to each grammar.
+ * @param grammars the grammars, highest priority first
+ * @param num_grammars the number of grammars
+ * @return the set or NULL
+ */
+struct srgs_grammar_set *srgs_grammar_set_new(struct srgs_grammar **grammars, int num_grammars)
+{
+  struct srgs_grammar_set *set;
+  std::vector<struct fsm_dfa *> dfas;
+  int i;
+
+  if (!grammars || num_grammars < 1) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "no grammars!\n");
+    }
+    return NULL;
+  }
+  for (i = 0; i < num_grammars; i++) {
+    if (!grammars[i]) {
+      if(globals.logging_callback) {
+        globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
+      }
+      return NULL;
+    }
+  }
+
+  set = (struct srgs_grammar_set *)malloc(sizeof(*set));
+  set->num_grammars = num_grammars;
+  set->grammars = (struct srgs_grammar **)malloc(sizeof(struct srgs_grammar *) * num_grammars);
+  set->dfas = (struct fsm_dfa **)malloc(sizeof(struct fsm_dfa *) * num_grammars);
+  set->components = (int *)malloc(sizeof(int) * num_grammars);
+  for (i = 0; i < num_grammars; i++) {
+    set->grammars[i] = srgs_grammar_ref(grammars[i]);
+    set->dfas[i] = get_compiled_dfa(grammars[i]);
+    set->components[i] = -1;
+    if (set->dfas[i]) {
+      set->components[i] = dfas.size();
+      dfas.push_back(set->dfas[i]);
+    }
+  }
+  set->product = dfas.empty() ? NULL : fsm_product_create(&dfas[0], dfas.size(), MAX_DFA_STATES);
+  if (!set->product && !dfas.empty() && globals.logging_callback) {
+    globals.logging_callback(NULL, CSPEECH_LOG_INFO, "grammar set too large to combine, matching grammars one at a time\n");
+  }
+  return set;
+}
+
+/**
+ * @return the order match results are reported in - complete matches first
+ */
+static int match_rank(enum srgs_match_type match)
+{
+  switch (match) {
+    case SMT_MATCH_END:
+      return 0;
+    case SMT_MATCH:
+      return 1;
+    default:
+      return 2;
   }
+}
 
-  /* travel through rule to detect loops */
-  if (node->type == SNT_REF) {
-    if (!resolve_refs(grammar, node->value.ref.node, level + 1)) {
-      return 0;
+/**
+ * Collect the match results of a grammar set
+ * @param set the grammar set
+ * @param state the product state reached by input
+ * @param states the DFA state of each grammar reached by input, used if there is no product
+ * @param input the input, NULL if sessions are used
+ * @param sessions the session of each grammar without a DFA, used if there is no input
+ * @param results set to the grammars that match input, at least the number of grammars in the set long
+ * @return the number of results
+ */
+static int grammar_set_results(struct srgs_grammar_set *set, int state, const int *states, const char *input, struct srgs_match_session **sessions, struct srgs_grammar_set_result *results)
+{
+  int num_results = 0;
+  int i;
+  for (i = 0; i < set->num_grammars; i++) {
+    struct srgs_grammar_set_result result;
+    int j;
+    result.grammar = set->grammars[i];
+    result.priority = i;
+    result.interpretation = NULL;
+    if (set->dfas[i]) {
+      int dfa_state = set->product ? set->product->components[state * set->product->num_dfas + set->components[i]] : states[i];
+      result.match = dfa_state_result(set->grammars[i], set->dfas[i], dfa_state, &result.interpretation);
+    } else if (input) {
+      result.match = srgs_grammar_match(set->grammars[i], input, &result.interpretation);
+    } else {
+      result.match = srgs_match_session_result(sessions[i], &result.interpretation);
+    }
+    if (result.match == SMT_NO_MATCH) {
+      continue;
     }
+    /* grammars arrive in priority order, so ties keep it */
+    for (j = num_results; j > 0 && match_rank(results[j - 1].match) > match_rank(result.match); j--) {
+      results[j] = results[j - 1];
+    }
+    results[j] = result;
+    num_results++;
   }
+  return num_results;
+}
 
-  /* resolve children refs */
-  if (node->child) {
-    struct srgs_node *child = node->child;
-    for (; child; child = child->next) {
-      if (!resolve_refs(grammar, child, level + 1)) {
-        return 0;
+/**
+ * Match input against every grammar in a set
+ * @param set the grammar set
+ * @param input the input to compare
+ * @param results set to the grammars that match input, at least the number
+ *        of grammars in the set long.  Complete matches come first, then
+ *        partial matches.  Grammars that match equally keep their set order.
+ * @return the number of results
+ */
+int srgs_grammar_set_match(struct srgs_grammar_set *set, const char *input, struct srgs_grammar_set_result *results)
+{
+  std::vector<int> states;
+  int state = FSM_DEAD_STATE;
+  int i;
+
+  if (cspeech_zstr(input)) {
+    return 0;
+  }
+  if (set->product) {
+    const char *c;
+    state = set->product->start;
+    for (c = input; *c && state != FSM_DEAD_STATE; c++) {
+      state = fsm_product_step(set->product, state, *c);
+    }
+  } else {
+    states.resize(set->num_grammars, FSM_DEAD_STATE);
+    for (i = 0; i < set->num_grammars; i++) {
+      if (set->dfas[i]) {
+        states[i] = fsm_dfa_run(set->dfas[i], input);
       }
     }
   }
-
-  node->visited = 0;
-  sn_log_node_close(node);
-  return 1;
+  return grammar_set_results(set, state, states.empty() ? NULL : &states[0], input, NULL, results);
 }
 
 /**
- * Parse the document into rules to match
- * @param parser the parser
- * @param document the document to parse
- * @return the parsed grammar if successful
+ * Destroy the grammar set
+ * @param set the grammar set
  */
-struct srgs_grammar *srgs_parse(struct srgs_parser *parser, const char *document)
+void srgs_grammar_set_destroy(struct srgs_grammar_set *set)
 {
-  struct srgs_grammar *grammar = NULL;
-  if (!parser) {
-    if(globals.logging_callback) {
-      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "NULL parser!!\n");
-    }
-    return NULL;
+  int i;
+  if (!set) {
+    return;
   }
+  for (i = 0; i < set->num_grammars; i++) {
+    srgs_grammar_unref(set->grammars[i]);
+  }
+  fsm_product_destroy(set->product);
+  free(set->grammars);
+  free(set->dfas);
+  free(set->components);
+  free(set);
+}
 
-  if (cspeech_zstr(document)) {
+/**
+ * Create a session for matching digits against a grammar set as they arrive
+ * @param set the grammar set, which must outlive the session
+ * @return the session or NULL
+ */
+struct srgs_grammar_set_session *srgs_grammar_set_session_new(struct srgs_grammar_set *set)
+{
+  struct srgs_grammar_set_session *session;
+  int i;
+  if (!set) {
     if(globals.logging_callback) {
-      globals.logging_callback(parser, CSPEECH_LOG_INFO, "Missing grammar document\n");
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar set is NULL!\n");
     }
     return NULL;
   }
+  session = (struct srgs_grammar_set_session *)malloc(sizeof(*session));
+  session->set = set;
+  session->states = (int *)malloc(sizeof(int) * set->num_grammars);
+  session->sessions = (struct srgs_match_session **)malloc(sizeof(struct srgs_match_session *) * set->num_grammars);
+  for (i = 0; i < set->num_grammars; i++) {
+    session->sessions[i] = set->dfas[i] ? NULL : srgs_match_session_new(set->grammars[i]);
+  }
+  srgs_grammar_set_session_reset(session);
+  return session;
+}
 
-  /* check for cached grammar */
-  switch_mutex_lock(parser->mutex);
-  grammar = (struct srgs_grammar *)switch_core_hash_find(parser->cache, document);
-  if (!grammar) {
-    int result = 0;
-    iksparser *p;
-    if(globals.logging_callback) {
-      globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Parsing new grammar\n");
-    }
-    grammar = srgs_grammar_new(parser);
-    p = iks_sax_new(grammar, tag_hook, cdata_hook);
-    if (iks_parse(p, document, 0, 1) == IKS_OK) {
-      if (grammar->root) {
-        if(globals.logging_callback) {
-          globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Resolving references\n");
-        }
-        if (resolve_refs(grammar, grammar->root, 0)) {
-          result = 1;
-        }
-      } else {
-        if(globals.logging_callback) {
-          globals.logging_callback(parser, CSPEECH_LOG_INFO, "Nothing to parse!\n");
-        }
-      }
-    }
-    iks_parser_delete(p);
-    if (result) {
-      switch_core_hash_insert(parser->cache, document, grammar);
-    } else {
-      if (grammar) {
-        srgs_grammar_destroy(grammar);
-        grammar = NULL;
-      }
-      if(globals.logging_callback) {
-        globals.logging_callback(parser, CSPEECH_LOG_INFO, "Failed to parse grammar\n");
-      }
-    }
-  } else {
-    if(globals.logging_callback) {
-      globals.logging_callback(parser, CSPEECH_LOG_DEBUG, "Using cached grammar\n");
+/**
+ * Discard all input
+ * @param session the session
+ */
+void srgs_grammar_set_session_reset(struct srgs_grammar_set_session *session)
+{
+  int i;
+  session->state = session->set->product ? session->set->product->start : FSM_DEAD_STATE;
+  for (i = 0; i < session->set->num_grammars; i++) {
+    session->states[i] = session->set->dfas[i] ? session->set->dfas[i]->start : FSM_DEAD_STATE;
+    if (session->sessions[i]) {
+      srgs_match_session_reset(session->sessions[i]);
     }
   }
-  switch_mutex_unlock(parser->mutex);
-
-  return grammar;
 }
 
-#define MAX_INPUT_SIZE 128
-#define OVECTOR_SIZE MAX_TAGS
-#define WORKSPACE_SIZE 1024
-
 /**
- * Check if no more digits can be added to input and match
- * @param compiled_regex the regex used in the initial match
- * @param input the input to check
- * @return true if end of match (no more input can be added)
+ * Add a chunk of input
+ * @param session the session
+ * @param input the input
+ * @param len the input length
+ * @param results set to the grammars that match all input so far, ordered
+ *        like srgs_grammar_set_match()
+ * @return the number of results
  */
-static int is_match_end(pcre *compiled_regex, const char *input)
+int srgs_grammar_set_session_feed(struct srgs_grammar_set_session *session, const char *input, size_t len, struct srgs_grammar_set_result *results)
 {
-  int ovector[OVECTOR_SIZE];
-  int input_size = strlen(input);
-  char search_input[MAX_INPUT_SIZE + 2];
-  const char *search_set = "0123456789#*ABCD";
-  const char *search = strchr(search_set, input[input_size - 1]); /* start with last digit in input */
-  int i = 0;
+  struct srgs_grammar_set *set = session->set;
+  size_t c;
+  int i;
 
-  /* For each digit in search_set, check if input + search_set digit is a potential match.
-     If so, then this is not a match end.
-   */
-  sprintf(search_input, "%sZ", input);
-  for (i = 0; i < 16; i++) {
-    int result;
-    if (!*search) {
-      search = search_set;
+  if (set->product) {
+    for (c = 0; c < len && session->state != FSM_DEAD_STATE; c++) {
+      session->state = fsm_product_step(set->product, session->state, input[c]);
     }
-    search_input[input_size] = *search++;
-    result = pcre_exec(compiled_regex, NULL, search_input, input_size + 1, 0, 0,
-      ovector, sizeof(ovector) / sizeof(ovector[0]));
-    if (result > 0) {
-      if(globals.logging_callback) {
-        globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "not match end\n");
+  }
+  for (i = 0; i < set->num_grammars; i++) {
+    if (session->sessions[i]) {
+      srgs_match_session_feed(session->sessions[i], input, len);
+    } else if (!set->product) {
+      for (c = 0; c < len && session->states[i] != FSM_DEAD_STATE; c++) {
+        session->states[i] = fsm_dfa_step(set->dfas[i], session->states[i], input[c]);
       }
-      return 0;
     }
   }
-  if(globals.logging_callback) {
-    globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "is match end\n");
-  }
-  return 1;
+  return grammar_set_results(set, session->state, session->states, NULL, session->sessions, results);
 }
 
 /**
- * Find a match
- * @param grammar the grammar to match
- * @param input the input to compare
- * @param interpretation the (optional) interpretation of the input result
- * @return the match result
+ * Add a digit to the input
+ * @param session the session
+ * @param digit the digit
+ * @param results set to the grammars that match all input so far, ordered
+ *        like srgs_grammar_set_match()
+ * @return the number of results
  */
-enum srgs_match_type srgs_grammar_match(struct srgs_grammar *grammar, const char *input, const char **interpretation)
+int srgs_grammar_set_session_feed_digit(struct srgs_grammar_set_session *session, char digit, struct srgs_grammar_set_result *results)
 {
-  int result = 0;
-  int ovector[OVECTOR_SIZE];
-  pcre *compiled_regex;
-
-  *interpretation = NULL;
+  return srgs_grammar_set_session_feed(session, &digit, 1, results);
+}
 
-  if (cspeech_zstr(input)) {
-    return SMT_NO_MATCH;
-  }
-  if (strlen(input) > MAX_INPUT_SIZE) {
-    if(globals.logging_callback) {
-      globals.logging_callback(NULL, CSPEECH_LOG_WARNING, "input too large: %s\n", input);
+/**
+ * Destroy the session
+ * @param session the session
+ */
+void srgs_grammar_set_session_destroy(struct srgs_grammar_set_session *session)
+{
+  int i;
+  for (i = 0; i < session->set->num_grammars; i++) {
+    if (session->sessions[i]) {
+      srgs_match_session_destroy(session->sessions[i]);
     }
-    return SMT_NO_MATCH;
-  }
-
-  if (!(compiled_regex = get_compiled_regex(grammar))) {
-    return SMT_NO_MATCH;
   }
-  result = pcre_exec(compiled_regex, NULL, input, strlen(input), 0, PCRE_PARTIAL,
-    ovector, OVECTOR_SIZE);
+  free(session->sessions);
+  free(session->states);
+  free(session);
+}
 
-  if(globals.logging_callback) {
-    globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "match = %i\n", result);
-  }
-  if (result > 0) {
-    int i;
-    char buffer[MAX_INPUT_SIZE + 1];
-    buffer[MAX_INPUT_SIZE] = '\0';
-
-    /* find matching instance... */
-    for (i = 1; i <= grammar->tag_count; i++) {
-      char substring_name[16] = { 0 };
-      buffer[0] = '\0';
-      snprintf(substring_name, 16, "%d", i);
-      if (pcre_copy_named_substring(compiled_regex, input, ovector, result, substring_name, buffer, MAX_INPUT_SIZE) != PCRE_ERROR_NOSUBSTRING && !zstr_buf(buffer)) {
-        *interpretation = grammar->tags[i];
-        break;
-      }
+/**
+ * Select the engine used to match a grammar.  New grammars use SME_AUTO,
+ * so this is only needed to force an engine.
+ * @param grammar the grammar
+ * @param engine the engine
+ * @return 1 if successful
+ */
+int srgs_grammar_set_engine(struct srgs_grammar *grammar, enum srgs_match_engine engine)
+{
+  if (!grammar) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
     }
+    return 0;
+  }
+  __atomic_store_n(&grammar->engine, engine, __ATOMIC_RELAXED);
+  return 1;
+}
 
-    if (is_match_end(compiled_regex, input)) {
-      return SMT_MATCH_END;
-    }
-    return SMT_MATCH;
+/**
+ * @param grammar the grammar
+ * @return the engine used to match the grammar.  If SME_AUTO was selected,
+ *         this is the engine picked for the grammar, or SME_AUTO until the
+ *         grammar is compiled or first matched.  Nothing is compiled here.
+ */
+enum srgs_match_engine srgs_grammar_get_engine(struct srgs_grammar *grammar)
+{
+  enum srgs_match_engine engine;
+  if (!grammar) {
+    return SME_PCRE;
   }
-  if (result == PCRE_ERROR_PARTIAL) {
-    return SMT_MATCH_PARTIAL;
+  engine = __atomic_load_n(&grammar->engine, __ATOMIC_RELAXED);
+  if (engine == SME_AUTO && is_published(grammar, GA_ENGINE)) {
+    return grammar->selected_engine;
   }
-
-  return SMT_NO_MATCH;
+  return engine;
 }
 
 /**
@@ -1403,10 +4535,18 @@ const char *srgs_grammar_to_regex(struct srgs_grammar *grammar)
     }
     return NULL;
   }
+  if (is_published(grammar, GA_REGEX)) {
+    return grammar->regex;
+  }
+
   switch_mutex_lock(grammar->mutex);
-  if (!grammar->regex && !create_regexes(grammar, grammar->root, NULL)) {
-    switch_mutex_unlock(grammar->mutex);
-    return NULL;
+  if (!is_published(grammar, GA_REGEX)) {
+    if (!create_regexes(grammar, grammar->root, NULL)) {
+      switch_mutex_unlock(grammar->mutex);
+      return NULL;
+    }
+    grammar_add_size(grammar, grammar->regex ? strlen(grammar->regex) + 1 : 0);
+    publish(grammar, GA_REGEX);
   }
   switch_mutex_unlock(grammar->mutex);
   return grammar->regex;
@@ -1427,7 +4567,10 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
       if (node->child) {
         struct srgs_node *child;
         switch_stream_handle_t new_stream = { 0 };
+        switch_stream_handle_t repeats = { 0 };
         SWITCH_STANDARD_STREAM(new_stream);
+        SWITCH_STANDARD_STREAM(repeats);
+        grammar->jsgf_repeats = &repeats;
 
         new_stream.write_function(&new_stream, "#JSGF V1.0");
         if (!cspeech_zstr(grammar->encoding)) {
@@ -1445,6 +4588,8 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
         if (grammar->root_rule) {
           if (!create_jsgf(grammar, grammar->root_rule, &new_stream)) {
             switch_safe_free(new_stream.data);
+            switch_safe_free(repeats.data);
+            grammar->jsgf_repeats = NULL;
             return 0;
           }
         } else {
@@ -1475,6 +4620,8 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
                 grammar->root_rule = child;
                 if (!create_jsgf(grammar, child, &new_stream)) {
                   switch_safe_free(new_stream.data);
+                  switch_safe_free(repeats.data);
+                  grammar->jsgf_repeats = NULL;
                   return 0;
                 } else {
                   break;
@@ -1489,11 +4636,19 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
           if (child->type == SNT_RULE && child != grammar->root_rule) {
             if (!create_jsgf(grammar, child, &new_stream)) {
               switch_safe_free(new_stream.data);
+              switch_safe_free(repeats.data);
+              grammar->jsgf_repeats = NULL;
               return 0;
             }
           }
         }
-        grammar->jsgf = strdup(new_stream.data);
+        /* then the rules for repeated items */
+        if (grammar->jsgf_repeat_count) {
+          new_stream.write_function(&new_stream, "%s", (char *)repeats.data);
+        }
+        grammar->jsgf_repeats = NULL;
+        switch_safe_free(repeats.data);
+        grammar->jsgf = switch_core_strdup(grammar->pool, new_stream.data);
         switch_safe_free(new_stream.data);
         if(globals.logging_callback) {
           globals.logging_callback(NULL, CSPEECH_LOG_DEBUG, "document jsgf = %s\n", grammar->jsgf);
@@ -1520,6 +4675,10 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
       int i;
       stream->write_function(stream, " ");
       for (i = 0; i < len; i++) {
+        if (i && grammar->digit_mode) {
+          /* each DTMF digit is a token */
+          stream->write_function(stream, " ");
+        }
         switch (node->value.string[i]) {
           case '\\':
           case '*':
@@ -1562,33 +4721,42 @@ static int create_jsgf(struct srgs_grammar *grammar, struct srgs_node *node, swi
             }
           }
           stream->write_function(stream, " ]");
+        } else if (node->value.item.repeat_min == 1 && node->value.item.repeat_max == 1) {
+          for(item = node->child; item; item = item->next) {
+            if (!create_jsgf(grammar, item, stream)) {
+              return 0;
+            }
+          }
         } else {
-          /* minimum repeats */
+          /* JSGF can't count, so write the item once and repeat a reference to it */
+          switch_stream_handle_t body = { 0 };
+          const char *unit;
           int i;
-          for (i = 0; i < node->value.item.repeat_min; i++) {
-            if (node->value.item.repeat_min != 1 && node->value.item.repeat_max != 1) {
-              stream->write_function(stream, " (");
-            }
-            for(item = node->child; item; item = item->next) {
-              if (!create_jsgf(grammar, item, stream)) {
-                return 0;
-              }
-            }
-            if (node->value.item.repeat_min != 1 && node->value.item.repeat_max != 1) {
-              stream->write_function(stream, " )");
+          SWITCH_STANDARD_STREAM(body);
+          for(item = node->child; item; item = item->next) {
+            if (!create_jsgf(grammar, item, &body)) {
+              switch_safe_free(body.data);
+              return 0;
             }
           }
+          if (node->num_children == 1 && (node->child->type == SNT_REF || node->child->type == SNT_STRING)) {
+            unit = switch_core_sprintf(grammar->pool, " (%s )", (char *)body.data);
+          } else {
+            unit = switch_core_sprintf(grammar->pool, " <_repeat%i>", ++grammar->jsgf_repeat_count);
+            grammar->jsgf_repeats->write_function(grammar->jsgf_repeats, "<_repeat%i> =%s;\n", grammar->jsgf_repeat_count, (char *)body.data);
+          }
+          switch_safe_free(body.data);
           if (node->value.item.repeat_max == INT_MAX) {
-            stream->write_function(stream, "*");
+            for (i = 1; i < node->value.item.repeat_min; i++) {
+              stream->write_function(stream, "%s", unit);
+            }
+            stream->write_function(stream, "%s%s", unit, node->value.item.repeat_min ? "+" : "*");
           } else {
-            for (;i < node->value.item.repeat_max; i++) {
-              stream->write_function(stream, " [");
-              for(item = node->child; item; item = item->next) {
-                if (!create_jsgf(grammar, item, stream)) {
-                  return 0;
-                }
-              }
-              stream->write_function(stream, " ]");
+            for (i = 0; i < node->value.item.repeat_min; i++) {
+              stream->write_function(stream, "%s", unit);
+            }
+            for (; i < node->value.item.repeat_max; i++) {
+              stream->write_function(stream, " [%s ]", unit);
             }
           }
         }
@@ -1642,10 +4810,18 @@ const char *srgs_grammar_to_jsgf(struct srgs_grammar *grammar)
     }
     return NULL;
   }
+  if (is_published(grammar, GA_JSGF)) {
+    return grammar->jsgf;
+  }
+
   switch_mutex_lock(grammar->mutex);
-  if (!grammar->jsgf && !create_jsgf(grammar, grammar->root, NULL)) {
-    switch_mutex_unlock(grammar->mutex);
-    return NULL;
+  if (!is_published(grammar, GA_JSGF)) {
+    if (!create_jsgf(grammar, grammar->root, NULL)) {
+      switch_mutex_unlock(grammar->mutex);
+      return NULL;
+    }
+    grammar_add_size(grammar, grammar->jsgf ? strlen(grammar->jsgf) + 1 : 0);
+    publish(grammar, GA_JSGF);
   }
   switch_mutex_unlock(grammar->mutex);
   return grammar->jsgf;
@@ -1666,8 +4842,12 @@ const char *srgs_grammar_to_jsgf_file(struct srgs_grammar *grammar, const char *
     }
     return NULL;
   }
+  if (is_published(grammar, GA_JSGF_FILE)) {
+    return grammar->jsgf_file_name;
+  }
+
   switch_mutex_lock(grammar->mutex);
-  if (!grammar->jsgf_file_name) {
+  if (!is_published(grammar, GA_JSGF_FILE)) {
     char file_name_buf[SWITCH_UUID_FORMATTED_LENGTH + 1];
     switch_file_t *file;
     switch_size_t len;
@@ -1691,16 +4871,164 @@ const char *srgs_grammar_to_jsgf_file(struct srgs_grammar *grammar, const char *
     len = strlen(jsgf);
     switch_file_write(file, jsgf, &len);
     switch_file_close(file);
+    publish(grammar, GA_JSGF_FILE);
   }
   switch_mutex_unlock(grammar->mutex);
   return grammar->jsgf_file_name;
 }
 
+/**
+ * Build everything needed to match the grammar and convert it to regex
+ * and JSGF.  After this the grammar is frozen: matching, regex and JSGF
+ * access never take the grammar mutex, so any number of threads can
+ * share it without waiting on each other.
+ * @param grammar the grammar
+ * @return 1 if the grammar is frozen
+ */
+int srgs_grammar_freeze(struct srgs_grammar *grammar)
+{
+  if (!grammar) {
+    if(globals.logging_callback) {
+      globals.logging_callback(NULL, CSPEECH_LOG_CRIT, "grammar is NULL!\n");
+    }
+    return 0;
+  }
+  get_compiled_regex(grammar);
+  get_compiled_dfa(grammar);
+  get_compiled_glushkov(grammar);
+  srgs_grammar_to_jsgf(grammar);
+  /* a tiered grammar doesn't need to wait for its upgrade now */
+  publish(grammar, GA_UPGRADED);
+  return is_published(grammar, GA_FROZEN);
+}
+
+/**
+ * @param grammar the grammar
+ * @return true if the grammar is frozen
+ */
+int srgs_grammar_is_frozen(struct srgs_grammar *grammar)
+{
+  return grammar && is_published(grammar, GA_FROZEN);
+}
+
+/**
+ * @param grammar the grammar
+ * @return true if the grammar is tiered and is matched by simulating its
+ *         program until its optimized matchers are built
+ */
+int srgs_grammar_is_upgrading(struct srgs_grammar *grammar)
+{
+  return grammar && is_upgrading(grammar);
+}
+
+/**
+ * Switch the vector instructions used by srgs_grammar_match_batch() on or off.
+ * They are off by default, the scalar DFA loop is faster on the CPUs
+ * measured so far.
+ * @param enabled true to use vector instructions if the CPU has them
+ * @return true if vector instructions are now used
+ */
+int srgs_set_simd(int enabled)
+{
+  return fsm_set_simd(enabled);
+}
+
+/**
+ * Choose how grammars parsed from now on are converted to regex.  By
+ * default every <ruleref> is replaced by the referenced rule, which
+ * makes the regex grow exponentially with layers of shared rules.  With
+ * subroutines enabled, rules without <tag>s are defined once and called
+ * with (?&name).  Rules with <tag>s are still inlined because PCRE
+ * discards captures made inside subroutine calls.  PCRE does not
+ * backtrack into a subroutine call once it returns, so rules that can
+ * match an input and a longer one starting with it (like 1|12) are
+ * inlined too.  Grammars match the same input either way.
+ * @param enabled true to use subroutines
+ */
+void srgs_set_regex_subroutines(int enabled)
+{
+  globals.regex_subroutines = enabled;
+}
+
+/**
+ * Choose whether grammars parsed from now on write runs of fixed string
+ * <one-of> alternatives as a prefix trie, so (?:john smith|john smyth)
+ * becomes john sm(?:ith|yth).  This helps grammars with many similar
+ * phrases, like directory dialing.
+ * @param enabled true to factor common prefixes
+ */
+void srgs_set_regex_prefix_factoring(int enabled)
+{
+  globals.regex_prefix_factoring = enabled;
+}
+
+/**
+ * Hold the background compilation of tiered grammars.  Grammars queued
+ * while paused keep matching by simulation until compilation resumes.
+ * This lets tests observe a tiered grammar before its upgrade.
+ * @param paused true to hold compilation, false to resume it
+ */
+void srgs_set_upgrades_paused(int paused)
+{
+  switch_mutex_lock(upgrades.mutex);
+  upgrades.paused = paused;
+  switch_thread_cond_broadcast(upgrades.queued);
+  switch_mutex_unlock(upgrades.mutex);
+}
+
+/**
+ * Switch matching with JIT compiled regexes on or off.  Grammars
+ * are always JIT compiled when PCRE supports it, so this can be
+ * changed at any time to compare against the interpreter.
+ * @param enabled true to use JIT code
+ * @return true if JIT code will be used
+ */
+int srgs_set_jit(int enabled)
+{
+  globals.jit = enabled && globals.jit_available;
+  return globals.jit;
+}
+
+/**
+ * Stop compiling tiered grammars in the background.  The worker thread
+ * finishes the grammar it is compiling and exits, and the references
+ * held by grammars still queued are released.  Those grammars, and any
+ * tiered grammars parsed afterwards, are compiled by their first match.
+ * Call before unloading the library.  This function is not thread safe.
+ */
+void srgs_shutdown(void)
+{
+  std::deque<struct srgs_grammar *> queued;
+  bool started;
+  switch_mutex_lock(upgrades.mutex);
+  upgrades.stopped = true;
+  started = upgrades.started;
+  upgrades.started = false;
+  switch_thread_cond_broadcast(upgrades.queued);
+  switch_mutex_unlock(upgrades.mutex);
+  if (started) {
+    pthread_join(upgrades.thread, NULL);
+  }
+
+  /* nothing is queued once stopped */
+  switch_mutex_lock(upgrades.mutex);
+  queued.swap(upgrades.grammars);
+  switch_mutex_unlock(upgrades.mutex);
+  while (!queued.empty()) {
+    struct srgs_grammar *grammar = queued.front();
+    queued.pop_front();
+    publish(grammar, GA_UPGRADED);
+    srgs_grammar_unref(grammar);
+  }
+}
+
 /**
  * Initialize SRGS parser.  This function is not thread safe.
  */
 int srgs_init(void)
 {
+  int i;
+
   if (globals.init) {
     return 1;
   }
@@ -1709,6 +5037,26 @@ int srgs_init(void)
   globals.logging_callback = NULL;
   switch_core_new_memory_pool(&globals.pool);
 
+#ifdef PCRE_STUDY_JIT_COMPILE
+  {
+    int jit = 0;
+    if (!pcre_config(PCRE_CONFIG_JIT, &jit) && jit && !pthread_key_create(&globals.jit_stack_key, jit_stack_destroy)) {
+      globals.jit_available = true;
+    }
+  }
+#endif
+  globals.jit = globals.jit_available;
+
+  for (i = 0; i < CACHE_SHARDS; i++) {
+    switch_core_hash_init(&cache.shards[i].entries, globals.pool);
+    switch_mutex_init(&cache.shards[i].mutex, SWITCH_MUTEX_DEFAULT, globals.pool);
+    switch_thread_cond_create(&cache.shards[i].parsed, globals.pool);
+  }
+  cache.max_entries = DEFAULT_CACHE_MAX_ENTRIES;
+  cache.max_bytes = DEFAULT_CACHE_MAX_BYTES;
+  switch_mutex_init(&upgrades.mutex, SWITCH_MUTEX_DEFAULT, globals.pool);
+  switch_thread_cond_create(&upgrades.queued, globals.pool);
+
   add_root_tag_def("grammar", process_grammar, process_cdata_bad, "meta,metadata,lexicon,tag,rule");
   add_tag_def("ruleref", process_ruleref, process_cdata_bad, "");
   add_tag_def("token", process_attribs_ignore, process_cdata_ignore, "");
@@ -13,8 +13,16 @@
 #ifndef SRGS_H
 #define SRGS_H
 
+#include <stddef.h>
+
 struct srgs_parser;
 struct srgs_grammar;
+struct srgs_match_session;
+struct srgs_grammar_set;
+struct srgs_grammar_set_session;
+
+/** DTMF symbols in srgs_grammar_next_symbols() bit order */
+#define SRGS_DTMF_SYMBOLS "0123456789#*ABCD"
 
 enum srgs_match_type {
   /** invalid input */
@@ -27,13 +35,111 @@ enum srgs_match_type {
   SMT_MATCH_END
 };
 
+enum srgs_match_engine {
+  /** backtracking PCRE regex */
+  SME_PCRE,
+  /** minimized DFA compiled from the SRGS tree */
+  SME_DFA,
+  /** NFA simulation of the matcher program */
+  SME_NFA,
+  /** bit-parallel Glushkov automaton, for grammars with few positions */
+  SME_GLUSHKOV,
+  /** picked from the shape of the grammar when it is compiled */
+  SME_AUTO
+};
+
+/**
+ * The interpretation of matched input
+ */
+struct srgs_interpretation {
+  /** the <tag> content, NULL if none */
+  const char *tag;
+  /** offset in input of the <tag>ged item */
+  int offset;
+  /** length of the <tag>ged item */
+  int length;
+};
+
+/**
+ * Match result of one input in a batch
+ */
+struct srgs_match_result {
+  /** the match result */
+  enum srgs_match_type match;
+  /** the interpretation of the input */
+  struct srgs_interpretation interpretation;
+};
+
+/**
+ * Match result of one grammar in a set
+ */
+struct srgs_grammar_set_result {
+  /** the grammar */
+  struct srgs_grammar *grammar;
+  /** position of the grammar in the set, lower wins ties */
+  int priority;
+  /** the match result */
+  enum srgs_match_type match;
+  /** the interpretation, NULL if none */
+  const char *interpretation;
+};
+
+/**
+ * Grammar cache statistics
+ */
+struct srgs_cache_stats {
+  /** lookups that found a cached or in-progress grammar */
+  unsigned long hits;
+  /** lookups that parsed the document */
+  unsigned long misses;
+  /** grammars evicted to stay within the cache limits */
+  unsigned long evictions;
+  /** grammars in the cache */
+  unsigned long entries;
+  /** estimated size of grammars in the cache */
+  size_t resident_bytes;
+};
+
 extern int srgs_init(void);
+extern void srgs_shutdown(void);
+extern int srgs_set_jit(int enabled);
+extern int srgs_set_simd(int enabled);
+extern void srgs_set_regex_subroutines(int enabled);
+extern void srgs_set_regex_prefix_factoring(int enabled);
+extern void srgs_set_cache_limits(unsigned long max_entries, size_t max_bytes);
+extern void srgs_get_cache_stats(struct srgs_cache_stats *stats);
 extern struct srgs_parser *srgs_parser_new(const char *uuid);
+extern void srgs_parser_set_eager_compile(struct srgs_parser *parser, int enabled);
+extern void srgs_parser_set_tiered_compile(struct srgs_parser *parser, int enabled);
 extern struct srgs_grammar *srgs_parse(struct srgs_parser *parser, const char *document);
+extern struct srgs_grammar *srgs_grammar_ref(struct srgs_grammar *grammar);
+extern void srgs_grammar_unref(struct srgs_grammar *grammar);
 extern const char *srgs_grammar_to_regex(struct srgs_grammar *grammar);
 extern const char *srgs_grammar_to_jsgf(struct srgs_grammar *grammar);
 extern const char *srgs_grammar_to_jsgf_file(struct srgs_grammar *grammar, const char *basedir, const char *ext);
 extern enum srgs_match_type srgs_grammar_match(struct srgs_grammar *grammar, const char *input, const char **interpretation);
+extern enum srgs_match_type srgs_grammar_match_interpretation(struct srgs_grammar *grammar, const char *input, struct srgs_interpretation *interpretation);
+extern int srgs_grammar_match_batch(struct srgs_grammar *grammar, const char **inputs, int num_inputs, struct srgs_match_result *results, int num_threads);
+extern int srgs_grammar_freeze(struct srgs_grammar *grammar);
+extern int srgs_grammar_is_frozen(struct srgs_grammar *grammar);
+extern unsigned int srgs_grammar_next_symbols(struct srgs_grammar *grammar, const char *input);
+extern int srgs_grammar_set_engine(struct srgs_grammar *grammar, enum srgs_match_engine engine);
+extern enum srgs_match_engine srgs_grammar_get_engine(struct srgs_grammar *grammar);
+extern struct srgs_match_session *srgs_match_session_new(struct srgs_grammar *grammar);
+extern enum srgs_match_type srgs_match_session_feed(struct srgs_match_session *session, const char *input, size_t len);
+extern enum srgs_match_type srgs_match_session_feed_digit(struct srgs_match_session *session, char digit);
+extern enum srgs_match_type srgs_match_session_result(struct srgs_match_session *session, const char **interpretation);
+extern unsigned int srgs_match_session_next_symbols(struct srgs_match_session *session);
+extern void srgs_match_session_reset(struct srgs_match_session *session);
+extern void srgs_match_session_destroy(struct srgs_match_session *session);
+extern struct srgs_grammar_set *srgs_grammar_set_new(struct srgs_grammar **grammars, int num_grammars);
+extern int srgs_grammar_set_match(struct srgs_grammar_set *set, const char *input, struct srgs_grammar_set_result *results);
+extern void srgs_grammar_set_destroy(struct srgs_grammar_set *set);
+extern struct srgs_grammar_set_session *srgs_grammar_set_session_new(struct srgs_grammar_set *set);
+extern int srgs_grammar_set_session_feed(struct srgs_grammar_set_session *session, const char *input, size_t len, struct srgs_grammar_set_result *results);
+extern int srgs_grammar_set_session_feed_digit(struct srgs_grammar_set_session *session, char digit, struct srgs_grammar_set_result *results);
+extern void srgs_grammar_set_session_reset(struct srgs_grammar_set_session *session);
+extern void srgs_grammar_set_session_destroy(struct srgs_grammar_set_session *session);
 extern void srgs_parser_destroy(struct srgs_parser *parser);
 
 #endif
@@ -0,0 +1,32 @@
+/*
+ * cspeech - Speech document (SSML, SRGS, NLSML) modelling and matching for C
+ * Copyright (C) 2013, Grasshopper
+ *
+ * License: MIT
+ *
+ * Contributor(s):
+ * Chris Rienzo <chris.rienzo@grasshopper.com>
+ *
+ * srgs_internal.h -- SRGS hooks for the tests, not installed
+ *
+ */
+#ifndef SRGS_INTERNAL_H
+#define SRGS_INTERNAL_H
+
+#include "srgs.h"
+
+extern void srgs_set_upgrades_paused(int paused);
+extern int srgs_grammar_is_upgrading(struct srgs_grammar *grammar);
+
+#endif
+
+/* For Emacs:
+ * Local Variables:
+ * mode:c
+ * indent-tabs-mode:t
+ * tab-width:4
+ * c-basic-offset:4
+ * End:
+ * For VIM:
+ * vim:set softtabstop=4 shiftwidth=4 tabstop=4 noet:
+ */
@@ -1,5 +1,8 @@
+#include <pthread.h>
+#include <time.h>
 #include "test.h"
 #include "cspeech/srgs.h"
+#include "cspeech/srgs_internal.h"
 
 static const char *adhearsion_menu_grammar =
   "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\" tag-format=\"semantics/1.0-literals\">"
@@ -1071,6 +1074,1455 @@ static void test_metadata_grammar(void)
   ASSERT_NOT_NULL(srgs_grammar_to_jsgf(grammar));
 }
 
+static const char *engine_test_inputs[] = {
+  "0", "1", "2", "3", "4", "5", "6", "7", "8", "9", "#", "*", "A",
+  "1#", "12", "12#", "123", "27", "223", "*9", "1111", "1111#", "1234#", "11115#",
+  "111156#", "1111567#", "0123456789*#",
+  "pleasedon't crash", "don't crash", "openthewindow", "closefile", "deletea menu",
+  "i need aclue", "have ananswer",
+  NULL
+};
+
+/**
+ * Check that the DFA engine matches the same as PCRE
+ * @param document the grammar to check
+ */
+static void assert_engines_match(const char *document)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, document)));
+  for (i = 0; engine_test_inputs[i]; i++) {
+    const char *pcre_interpretation;
+    const char *dfa_interpretation;
+    const char *nfa_interpretation;
+    const char *glushkov_interpretation;
+    enum srgs_match_type pcre_result;
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_PCRE));
+    pcre_result = srgs_grammar_match(grammar, engine_test_inputs[i], &pcre_interpretation);
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+    ASSERT_EQUALS(SME_DFA, srgs_grammar_get_engine(grammar));
+    ASSERT_EQUALS(pcre_result, srgs_grammar_match(grammar, engine_test_inputs[i], &dfa_interpretation));
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_NFA));
+    ASSERT_EQUALS(pcre_result, srgs_grammar_match(grammar, engine_test_inputs[i], &nfa_interpretation));
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_GLUSHKOV));
+    ASSERT_EQUALS(pcre_result, srgs_grammar_match(grammar, engine_test_inputs[i], &glushkov_interpretation));
+    if (pcre_interpretation) {
+      ASSERT_STRING_EQUALS(pcre_interpretation, dfa_interpretation);
+      ASSERT_STRING_EQUALS(pcre_interpretation, nfa_interpretation);
+      ASSERT_STRING_EQUALS(pcre_interpretation, glushkov_interpretation);
+    } else {
+      ASSERT_NULL(dfa_interpretation);
+      ASSERT_NULL(nfa_interpretation);
+      ASSERT_NULL(glushkov_interpretation);
+    }
+  }
+  /* the grammar is cached, let the next test pick its engine */
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * Test DFA engine against PCRE engine
+ */
+static void test_match_dfa_engine(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  const char *interpretation;
+
+  assert_engines_match(adhearsion_menu_grammar);
+  assert_engines_match(duplicate_tag_grammar);
+  assert_engines_match(adhearsion_ask_grammar);
+  assert_engines_match(multi_digit_grammar);
+  assert_engines_match(multi_rule_grammar);
+  assert_engines_match(rayo_example_grammar);
+  assert_engines_match(repeat_item_grammar);
+  assert_engines_match(repeat_item_range_grammar);
+  assert_engines_match(repeat_item_optional_grammar);
+  assert_engines_match(repeat_item_star_grammar);
+  assert_engines_match(repeat_item_plus_grammar);
+  assert_engines_match(repeat_item_range_ambiguous_grammar);
+  assert_engines_match(repeat_item_range_optional_pound_grammar);
+  assert_engines_match(voice_srgs1);
+  assert_engines_match(rayo_test_srgs);
+  assert_engines_match(w3c_example_grammar);
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, w3c_example_grammar)));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "closethewindow", &interpretation));
+  ASSERT_EQUALS(SME_DFA, srgs_grammar_get_engine(grammar));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_PCRE));
+  ASSERT_EQUALS(SME_PCRE, srgs_grammar_get_engine(grammar));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "closethewindow", &interpretation));
+  ASSERT_STRING_EQUALS("TAG-CONTENT-2", interpretation);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "movemenu", &interpretation));
+  ASSERT_STRING_EQUALS("TAG-CONTENT-4", interpretation);
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match(grammar, "openthe", &interpretation));
+  ASSERT_NULL(interpretation);
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "openthe door", &interpretation));
+  ASSERT_NULL(interpretation);
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  ASSERT_EQUALS(0, srgs_grammar_set_engine(NULL, SME_DFA));
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * Check that a session matches each prefix of input the same as srgs_grammar_match()
+ * @param grammar the grammar
+ * @param input the digits to feed
+ */
+static void assert_session_matches(struct srgs_grammar *grammar, const char *input)
+{
+  struct srgs_match_session *session;
+  char prefix[64] = { 0 };
+  int i;
+
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  for (i = 0; input[i]; i++) {
+    const char *expected_interpretation;
+    const char *interpretation;
+    enum srgs_match_type expected;
+    prefix[i] = input[i];
+    expected = srgs_grammar_match(grammar, prefix, &expected_interpretation);
+    ASSERT_EQUALS(expected, srgs_match_session_feed_digit(session, input[i]));
+    ASSERT_EQUALS(expected, srgs_match_session_result(session, &interpretation));
+    if (expected_interpretation) {
+      ASSERT_STRING_EQUALS(expected_interpretation, interpretation);
+    } else {
+      ASSERT_NULL(interpretation);
+    }
+  }
+  srgs_match_session_destroy(session);
+}
+
+/**
+ * Test matching one digit at a time
+ */
+static void test_match_session(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_match_session *session;
+  const char *interpretation;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NULL(srgs_match_session_new(NULL));
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_match_session_result(session, &interpretation));
+  ASSERT_NULL(interpretation);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed_digit(session, '7'));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_result(session, &interpretation));
+  ASSERT_STRING_EQUALS("2", interpretation);
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_match_session_feed_digit(session, '7'));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_match_session_feed_digit(session, '1'));
+  srgs_match_session_reset(session);
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_match_session_result(session, &interpretation));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed_digit(session, '9'));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_result(session, &interpretation));
+  ASSERT_STRING_EQUALS("3", interpretation);
+  srgs_match_session_destroy(session);
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed_digit(session, '1'));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed_digit(session, '2'));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed_digit(session, '3'));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed_digit(session, '4'));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed_digit(session, '#'));
+  srgs_match_session_destroy(session);
+
+  assert_session_matches(grammar, "*9");
+  assert_session_matches(grammar, "0123456789*#");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, repeat_item_plus_grammar)));
+  assert_session_matches(grammar, "111156#");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, repeat_item_range_optional_pound_grammar)));
+  assert_session_matches(grammar, "12#");
+  assert_session_matches(grammar, "123");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, duplicate_tag_grammar)));
+  assert_session_matches(grammar, "9");
+  assert_session_matches(grammar, "55");
+
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * @param symbols the DTMF symbols
+ * @return the symbols as a srgs_grammar_next_symbols() bit mask
+ */
+static unsigned int dtmf_mask(const char *symbols)
+{
+  unsigned int mask = 0;
+  for (; *symbols; symbols++) {
+    mask |= 1 << (strchr(SRGS_DTMF_SYMBOLS, *symbols) - SRGS_DTMF_SYMBOLS);
+  }
+  return mask;
+}
+
+/**
+ * Test finding which DTMF symbols can follow input
+ */
+static void test_next_symbols(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_match_session *session;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_EQUALS(0, srgs_grammar_next_symbols(NULL, ""));
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(dtmf_mask("1579"), srgs_grammar_next_symbols(grammar, ""));
+  ASSERT_EQUALS(dtmf_mask("1579"), srgs_grammar_next_symbols(grammar, NULL));
+  ASSERT_EQUALS(0, srgs_grammar_next_symbols(grammar, "1"));
+  ASSERT_EQUALS(0, srgs_grammar_next_symbols(grammar, "2"));
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(dtmf_mask("0123456789*"), srgs_grammar_next_symbols(grammar, ""));
+  ASSERT_EQUALS(dtmf_mask("9"), srgs_grammar_next_symbols(grammar, "*"));
+  ASSERT_EQUALS(dtmf_mask("0123456789"), srgs_grammar_next_symbols(grammar, "123"));
+  ASSERT_EQUALS(dtmf_mask("#"), srgs_grammar_next_symbols(grammar, "1234"));
+  ASSERT_EQUALS(0, srgs_grammar_next_symbols(grammar, "1234#"));
+
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  ASSERT_EQUALS(dtmf_mask("0123456789*"), srgs_match_session_next_symbols(session));
+  srgs_match_session_feed_digit(session, '*');
+  ASSERT_EQUALS(dtmf_mask("9"), srgs_match_session_next_symbols(session));
+  srgs_match_session_feed_digit(session, '9');
+  ASSERT_EQUALS(0, srgs_match_session_next_symbols(session));
+  srgs_match_session_destroy(session);
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, repeat_item_range_optional_pound_grammar)));
+  ASSERT_EQUALS(dtmf_mask("0123456789#"), srgs_grammar_next_symbols(grammar, "1"));
+  ASSERT_EQUALS(dtmf_mask("0123456789#"), srgs_grammar_next_symbols(grammar, "12"));
+  ASSERT_EQUALS(0, srgs_grammar_next_symbols(grammar, "123"));
+
+  srgs_parser_destroy(parser);
+}
+
+static const char *star_menu_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\" tag-format=\"semantics/1.0-literals\">"
+  "  <rule id=\"options\" scope=\"public\">\n"
+  "    <item repeat=\"0-1\">*</item>\n"
+  "    <one-of>\n"
+  "      <item><tag>yes</tag>1</item>\n"
+  "      <item><tag>no</tag>22</item>\n"
+  "    </one-of>\n"
+  "  </rule>\n"
+  "</grammar>\n";
+
+/**
+ * Check that all engines find the same interpretation span
+ */
+static void assert_interpretation(struct srgs_grammar *grammar, const char *input, enum srgs_match_type match, const char *tag, int offset, int length)
+{
+  struct srgs_interpretation interpretation;
+  int i;
+
+  for (i = SME_PCRE; i <= SME_GLUSHKOV; i++) {
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, (enum srgs_match_engine)i));
+    ASSERT_EQUALS(match, srgs_grammar_match_interpretation(grammar, input, &interpretation));
+    if (tag) {
+      ASSERT_STRING_EQUALS(tag, interpretation.tag);
+      ASSERT_EQUALS(offset, interpretation.offset);
+      ASSERT_EQUALS(length, interpretation.length);
+    } else {
+      ASSERT_NULL(interpretation.tag);
+    }
+  }
+  /* the grammar is cached, let other tests pick its engine */
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+}
+
+/**
+ * Test finding where the interpretation matched the input
+ */
+static void test_match_interpretation(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+
+  parser = srgs_parser_new("1234");
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  assert_interpretation(grammar, "7", SMT_MATCH_END, "2", 0, 1);
+  assert_interpretation(grammar, "8", SMT_NO_MATCH, NULL, 0, 0);
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, star_menu_grammar)));
+  assert_interpretation(grammar, "1", SMT_MATCH_END, "yes", 0, 1);
+  assert_interpretation(grammar, "*1", SMT_MATCH_END, "yes", 1, 1);
+  assert_interpretation(grammar, "*22", SMT_MATCH_END, "no", 1, 2);
+  assert_interpretation(grammar, "*2", SMT_MATCH_PARTIAL, NULL, 0, 0);
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, w3c_example_grammar)));
+  assert_interpretation(grammar, "closethewindow", SMT_MATCH_END, "TAG-CONTENT-2", 0, 5);
+
+  srgs_parser_destroy(parser);
+}
+
+#define BENCHMARK_ITERATIONS 10000
+
+/**
+ * Time matching input against grammar with the current JIT setting
+ * @return the nanoseconds per match
+ */
+static double time_match(struct srgs_grammar *grammar, const char *input, enum srgs_match_type expected)
+{
+  const char *interpretation;
+  clock_t start = clock();
+  int i;
+  for (i = 0; i < BENCHMARK_ITERATIONS; i++) {
+    if (srgs_grammar_match(grammar, input, &interpretation) != expected) {
+      return -1.0;
+    }
+  }
+  return (double)(clock() - start) * 1000000000.0 / CLOCKS_PER_SEC / BENCHMARK_ITERATIONS;
+}
+
+/**
+ * Compare match cost with and without JIT on the test grammars
+ */
+static void test_match_jit_benchmark(void)
+{
+  static const struct {
+    const char **document;
+    const char *name;
+    const char *input;
+    enum srgs_match_type expected;
+  } benchmarks[] = {
+    { &adhearsion_menu_grammar, "adhearsion_menu", "7", SMT_MATCH_END },
+    { &adhearsion_ask_grammar, "adhearsion_ask", "1", SMT_MATCH_END },
+    { &rayo_example_grammar, "rayo_example", "1234#", SMT_MATCH_END },
+    { &repeat_item_range_optional_pound_grammar, "repeat_item_range_optional_pound", "12#", SMT_MATCH_END },
+    { &w3c_example_grammar, "w3c_example", "closethewindow", SMT_MATCH_END }
+  };
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  int jit_available = srgs_set_jit(1);
+  int i;
+
+  parser = srgs_parser_new("1234");
+  for (i = 0; i < (int)(sizeof(benchmarks) / sizeof(benchmarks[0])); i++) {
+    double interpreted, jit;
+    ASSERT_NOT_NULL((grammar = srgs_parse(parser, *benchmarks[i].document)));
+    /* the grammar may be matched with another engine by default */
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_PCRE));
+    srgs_set_jit(0);
+    interpreted = time_match(grammar, benchmarks[i].input, benchmarks[i].expected);
+    ASSERT_EQUALS(1, interpreted >= 0.0);
+    srgs_set_jit(1);
+    jit = time_match(grammar, benchmarks[i].input, benchmarks[i].expected);
+    ASSERT_EQUALS(1, jit >= 0.0);
+    printf("BENCH\t%s\tinterpreter %.0f ns/match\tjit%s %.0f ns/match\n", benchmarks[i].name,
+      interpreted, jit_available ? "" : " (unavailable)", jit);
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  }
+  srgs_set_jit(jit_available);
+  srgs_parser_destroy(parser);
+}
+
+#define FROZEN_MATCH_THREADS 4
+
+/**
+ * Match menu choices against a shared grammar
+ * @param grammar the grammar
+ * @return NULL if every match succeeded
+ */
+static void *match_frozen_grammar(void *grammar)
+{
+  const char *interpretation;
+  int i;
+  for (i = 0; i < 1000; i++) {
+    if (srgs_grammar_match((struct srgs_grammar *)grammar, "7", &interpretation) != SMT_MATCH_END ||
+      strcmp("2", interpretation)) {
+      return grammar;
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Test matching a frozen grammar from many threads
+ */
+static void test_frozen_grammar(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  pthread_t threads[FROZEN_MATCH_THREADS];
+  const char *regex;
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_EQUALS(0, srgs_grammar_freeze(NULL));
+  ASSERT_EQUALS(0, srgs_grammar_is_frozen(NULL));
+
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(0, srgs_grammar_is_frozen(grammar));
+  ASSERT_EQUALS(1, srgs_grammar_freeze(grammar));
+  ASSERT_EQUALS(1, srgs_grammar_is_frozen(grammar));
+  ASSERT_NOT_NULL((regex = srgs_grammar_to_regex(grammar)));
+  ASSERT_EQUALS(1, regex == srgs_grammar_to_regex(grammar));
+  ASSERT_NOT_NULL(srgs_grammar_to_jsgf(grammar));
+
+  for (i = 0; i < FROZEN_MATCH_THREADS; i++) {
+    ASSERT_EQUALS(0, pthread_create(&threads[i], NULL, match_frozen_grammar, grammar));
+  }
+  for (i = 0; i < FROZEN_MATCH_THREADS; i++) {
+    void *failed;
+    ASSERT_EQUALS(0, pthread_join(threads[i], &failed));
+    ASSERT_NULL(failed);
+  }
+
+  srgs_parser_destroy(parser);
+}
+
+#define PARSE_THREADS 8
+
+/**
+ * A document parsed concurrently
+ */
+struct concurrent_parse {
+  struct srgs_parser *parser;
+  const char *document;
+  struct srgs_grammar *grammar;
+};
+
+/**
+ * Parse a document shared with other threads
+ * @param parse the concurrent_parse
+ * @return NULL
+ */
+static void *parse_shared_document(void *parse)
+{
+  struct concurrent_parse *p = (struct concurrent_parse *)parse;
+  p->grammar = srgs_parse(p->parser, p->document);
+  return NULL;
+}
+
+/**
+ * Parse document from many threads at once
+ * @return the grammar all threads got
+ */
+static struct srgs_grammar *parse_concurrently(struct srgs_parser *parser, const char *document)
+{
+  pthread_t threads[PARSE_THREADS];
+  struct concurrent_parse parses[PARSE_THREADS];
+  int i;
+
+  for (i = 0; i < PARSE_THREADS; i++) {
+    parses[i].parser = parser;
+    parses[i].document = document;
+    parses[i].grammar = NULL;
+    ASSERT_EQUALS(0, pthread_create(&threads[i], NULL, parse_shared_document, &parses[i]));
+  }
+  for (i = 0; i < PARSE_THREADS; i++) {
+    ASSERT_EQUALS(0, pthread_join(threads[i], NULL));
+  }
+  for (i = 1; i < PARSE_THREADS; i++) {
+    ASSERT_EQUALS(1, parses[0].grammar == parses[i].grammar);
+  }
+  return parses[0].grammar;
+}
+
+/**
+ * Test that concurrent parses of one document share a single grammar
+ */
+static void test_concurrent_parse(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = parse_concurrently(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(1, grammar == srgs_parse(parser, rayo_example_grammar));
+  ASSERT_NOT_NULL(parse_concurrently(parser, adhearsion_menu_grammar));
+  ASSERT_NULL(parse_concurrently(parser, bad_ref_grammar));
+  ASSERT_NULL(srgs_parse(parser, bad_ref_grammar));
+  srgs_parser_destroy(parser);
+}
+
+static const char *adhearsion_menu_grammar_reformatted =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\"  version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\" tag-format=\"semantics/1.0-literals\">\n"
+  "<rule id=\"options\" scope=\"public\">\n"
+  "  <one-of>\n"
+  "    <item> <tag>0</tag> 1 </item>\n"
+  "    <item> <tag>1</tag> 5 </item>\n"
+  "    <item> <tag>2</tag> 7 </item>\n"
+  "    <item> <tag>3</tag> 9 </item>\n"
+  "  </one-of>\n"
+  "</rule>\n"
+  "</grammar>";
+
+static const char *adhearsion_menu_grammar_tag_spaces =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\" tag-format=\"semantics/1.0-literals\">"
+  "  <rule id=\"options\" scope=\"public\">\n"
+  "    <one-of>\n"
+  "      <item><tag> 0</tag>1</item>\n"
+  "      <item><tag> 1</tag>5</item>\n"
+  "      <item><tag> 2</tag>7</item>\n"
+  "      <item><tag> 3</tag>9</item>\n"
+  "    </one-of>\n"
+  "  </rule>\n"
+  "</grammar>\n";
+
+static const char *voice_name_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"voice\" root=\"name\">\n"
+  "  <rule id=\"name\" scope=\"public\"><item> john smith </item></rule>\n"
+  "</grammar>\n";
+
+static const char *voice_name_grammar_spaces =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"voice\" root=\"name\">\n"
+  "  <rule id=\"name\" scope=\"public\"><item> john  smith </item></rule>\n"
+  "</grammar>\n";
+
+/**
+ * Test grammar cache keys, eviction and statistics
+ */
+static void test_grammar_cache(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_parser *other_parser;
+  struct srgs_grammar *menu;
+  struct srgs_grammar *tag_spaces;
+  struct srgs_grammar *rayo;
+  struct srgs_grammar *grammar;
+  struct srgs_cache_stats before;
+  struct srgs_cache_stats stats;
+  const char *interpretation;
+  size_t resident_bytes;
+
+  /* start with an empty cache */
+  srgs_set_cache_limits(0, 1);
+  srgs_set_cache_limits(2, 0);
+  srgs_get_cache_stats(&before);
+  ASSERT_EQUALS(0, before.entries);
+  ASSERT_EQUALS(0, before.resident_bytes);
+
+  parser = srgs_parser_new("1234");
+  other_parser = srgs_parser_new("5678");
+  ASSERT_NOT_NULL((menu = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(1, menu == srgs_parse(other_parser, adhearsion_menu_grammar_reformatted));
+  srgs_parser_destroy(other_parser);
+  srgs_get_cache_stats(&stats);
+  ASSERT_EQUALS(1, stats.hits - before.hits);
+  ASSERT_EQUALS(1, stats.misses - before.misses);
+  ASSERT_EQUALS(1, stats.entries);
+  ASSERT_EQUALS(1, stats.resident_bytes > 0);
+
+  /* matchers count towards the cache size once built */
+  resident_bytes = stats.resident_bytes;
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(menu, "7", &interpretation));
+  srgs_get_cache_stats(&stats);
+  ASSERT_EQUALS(1, stats.resident_bytes > resident_bytes);
+
+  /* whitespace in <tag> is part of the interpretation */
+  ASSERT_NOT_NULL((tag_spaces = srgs_parse(parser, adhearsion_menu_grammar_tag_spaces)));
+  ASSERT_EQUALS(0, menu == tag_spaces);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(tag_spaces, "7", &interpretation));
+  ASSERT_STRING_EQUALS(" 2", interpretation);
+
+  /* least recently used grammar is evicted but all stay valid while referenced */
+  ASSERT_NOT_NULL((rayo = srgs_parse(parser, rayo_example_grammar)));
+  srgs_get_cache_stats(&stats);
+  ASSERT_EQUALS(1, stats.evictions - before.evictions);
+  ASSERT_EQUALS(2, stats.entries);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(menu, "7", &interpretation));
+  ASSERT_STRING_EQUALS("2", interpretation);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(tag_spaces, "7", &interpretation));
+  ASSERT_STRING_EQUALS(" 2", interpretation);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(rayo, "1234#", &interpretation));
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(0, grammar == menu);
+  srgs_get_cache_stats(&stats);
+  ASSERT_EQUALS(4, stats.misses - before.misses);
+  ASSERT_EQUALS(2, stats.evictions - before.evictions);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(1, grammar == rayo);
+
+  /* grammars still referenced outlive the cache and their parser */
+  srgs_grammar_ref(rayo);
+  srgs_grammar_ref(tag_spaces);
+  srgs_grammar_ref(menu);
+  srgs_parser_destroy(parser);
+  srgs_set_cache_limits(0, 1);
+  srgs_get_cache_stats(&stats);
+  ASSERT_EQUALS(0, stats.entries);
+  ASSERT_EQUALS(0, stats.resident_bytes);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(rayo, "1234#", &interpretation));
+  srgs_grammar_unref(rayo);
+  srgs_grammar_unref(tag_spaces);
+  srgs_grammar_unref(menu);
+
+  srgs_set_cache_limits(1000, 64 * 1024 * 1024);
+
+  /* whitespace inside voice tokens is part of the grammar */
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((menu = srgs_parse(parser, voice_name_grammar)));
+  ASSERT_NOT_NULL((tag_spaces = srgs_parse(parser, voice_name_grammar_spaces)));
+  ASSERT_EQUALS(0, menu == tag_spaces);
+  ASSERT_NOT_NULL(strstr(srgs_grammar_to_regex(tag_spaces), "john  smith"));
+  ASSERT_NULL(strstr(srgs_grammar_to_regex(menu), "john  smith"));
+  srgs_parser_destroy(parser);
+}
+
+#define LARGE_ONE_OF_ITEMS 2000
+
+/**
+ * Test parsing a <one-of> with many items
+ */
+static void test_large_one_of(void)
+{
+  static const char *header =
+    "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\">"
+    "<rule id=\"options\" scope=\"public\"><one-of>";
+  static const char *footer = "</one-of></rule></grammar>";
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  const char *interpretation;
+  char *document;
+  char *end;
+  int i;
+
+  document = (char *)malloc(strlen(header) + strlen(footer) + LARGE_ONE_OF_ITEMS * 32);
+  end = document + sprintf(document, "%s", header);
+  for (i = 0; i < LARGE_ONE_OF_ITEMS; i++) {
+    end += sprintf(end, "<item>%i</item>", i);
+  }
+  sprintf(end, "%s", footer);
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, document)));
+  ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match(grammar, "1", &interpretation));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1999", &interpretation));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "2000", &interpretation));
+  srgs_parser_destroy(parser);
+  free(document);
+}
+
+static const char *rule_loop_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"a\">"
+  "  <rule id=\"a\"><item>1</item><ruleref uri=\"#b\"/></rule>\n"
+  "  <rule id=\"b\"><one-of><item>2</item><item><ruleref uri=\"#c\"/></item></one-of></rule>\n"
+  "  <rule id=\"c\"><ruleref uri=\"#a\"/></rule>\n"
+  "</grammar>\n";
+
+#define LAYERED_RULES 40
+
+/**
+ * Test resolving rules that share sub-rules and rules that loop
+ */
+static void test_resolve_refs(void)
+{
+  static const char *header =
+    "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"r0\">";
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  char *document;
+  char *end;
+  int i;
+
+  /* each rule references the next twice - walking every path would take 2^40 steps */
+  document = (char *)malloc(strlen(header) + LAYERED_RULES * 128);
+  end = document + sprintf(document, "%s", header);
+  for (i = 0; i < LAYERED_RULES; i++) {
+    end += sprintf(end, "<rule id=\"r%i\"><ruleref uri=\"#r%i\"/><ruleref uri=\"#r%i\"/></rule>", i, i + 1, i + 1);
+  }
+  sprintf(end, "<rule id=\"r%i\">1</rule></grammar>", LAYERED_RULES);
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, document)));
+  ASSERT_NULL(srgs_parse(parser, rule_loop_grammar));
+  srgs_parser_destroy(parser);
+  free(document);
+}
+
+static const char *subroutine_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"main\">"
+  "  <rule id=\"digit\">"
+  "    <one-of><item>1</item><item>2</item></one-of>"
+  "  </rule>"
+  "  <rule id=\"pin\">"
+  "    <ruleref uri=\"#digit\"/><ruleref uri=\"#digit\"/>"
+  "  </rule>"
+  "  <rule id=\"confirm\">"
+  "    <item><tag>yes</tag>*</item>"
+  "  </rule>"
+  "  <rule id=\"main\" scope=\"public\">"
+  "    <ruleref uri=\"#pin\"/><ruleref uri=\"#digit\"/><ruleref uri=\"#confirm\"/>"
+  "  </rule>"
+  "</grammar>";
+
+static const char *prefix_subroutine_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"main\">"
+  "  <rule id=\"digit\">"
+  "    <one-of><item>1</item><item>2</item></one-of>"
+  "  </rule>"
+  "  <rule id=\"prefix\">"
+  "    <one-of><item>1</item><item>12</item></one-of>"
+  "  </rule>"
+  "  <rule id=\"main\" scope=\"public\">"
+  "    <ruleref uri=\"#prefix\"/>2<ruleref uri=\"#digit\"/>"
+  "  </rule>"
+  "</grammar>";
+
+/**
+ * Test calling rules without <tag>s as regex subroutines
+ */
+static void test_regex_subroutines(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_grammar *inlined;
+  const char *interpretation;
+
+  srgs_set_regex_subroutines(1);
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, subroutine_grammar)));
+  srgs_set_regex_subroutines(0);
+  /* tag-free rules are defined once, confirm is inlined to keep its capture */
+  ASSERT_STRING_EQUALS("^(?&r2)(?&r1)(?P<1>\\*)$(?(DEFINE)(?<r1>[12])(?<r2>(?&r1)(?&r1)))", srgs_grammar_to_regex(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "122*", &interpretation));
+  ASSERT_STRING_EQUALS("yes", interpretation);
+
+  /* the cached grammar is only shared with parses using subroutines */
+  ASSERT_NOT_NULL((inlined = srgs_parse(parser, subroutine_grammar)));
+  ASSERT_EQUALS(0, inlined == grammar);
+  ASSERT_STRING_EQUALS("^[12][12][12](?P<1>\\*)$", srgs_grammar_to_regex(inlined));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(inlined, "122*", &interpretation));
+  ASSERT_STRING_EQUALS("yes", interpretation);
+
+  /* a call can't give back the 2 of 12, so that rule is inlined */
+  srgs_set_regex_subroutines(1);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, prefix_subroutine_grammar)));
+  srgs_set_regex_subroutines(0);
+  ASSERT_STRING_EQUALS("^(?:1|12)2(?&r1)$(?(DEFINE)(?<r1>[12]))", srgs_grammar_to_regex(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "121", &interpretation));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1221", &interpretation));
+  srgs_parser_destroy(parser);
+}
+
+static const char *simplify_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"main\">"
+  "  <rule id=\"main\" scope=\"public\">"
+  "    <item>1<item>23</item></item>"
+  "    <item></item>"
+  "    <one-of>"
+  "      <item>4</item>"
+  "      <item><one-of><item>5</item><item>6</item></one-of></item>"
+  "    </one-of>"
+  "    <item repeat=\"0-\"><one-of><item>7</item><item>8</item></one-of></item>"
+  "    <item repeat=\"2\">9</item>"
+  "    <one-of><item><tag>star</tag>*</item></one-of>"
+  "  </rule>"
+  "</grammar>";
+
+/**
+ * Test the parse tree is simplified before it is converted
+ */
+static void test_simplify(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  const char *interpretation;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, simplify_grammar)));
+  ASSERT_STRING_EQUALS("^123[456][78]*9{2}(?P<1>\\*)$", srgs_grammar_to_regex(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1236799*", &interpretation));
+  ASSERT_STRING_EQUALS("star", interpretation);
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "123499*", &interpretation));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "12399*", &interpretation));
+  srgs_parser_destroy(parser);
+}
+
+static const char *directory_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"voice\" root=\"names\">"
+  "  <rule id=\"names\" scope=\"public\">"
+  "    <one-of>"
+  "      <item>john smith<tag>100</tag></item>"
+  "      <item>john<tag>101</tag></item>"
+  "      <item>john smyth<tag>102</tag></item>"
+  "      <item>joan</item>"
+  "      <item repeat=\"2\">jo</item>"
+  "      <item>joe</item>"
+  "      <item>jack</item>"
+  "    </one-of>"
+  "  </rule>"
+  "</grammar>";
+
+/**
+ * Test factoring common prefixes out of <one-of> regexes
+ */
+static void test_regex_prefix_factoring(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_grammar *unfactored;
+  const char *interpretation;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((unfactored = srgs_parse(parser, directory_grammar)));
+
+  /* the grammar parsed without factoring is not shared */
+  srgs_set_regex_prefix_factoring(1);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, directory_grammar)));
+  srgs_set_regex_prefix_factoring(0);
+  ASSERT_EQUALS(0, grammar == unfactored);
+  ASSERT_STRING_EQUALS("^(?:(?P<1>john smith)|(?P<2>john)|(?P<3>john smyth)|joan|(?:jo){2}|joe|jack)$", srgs_grammar_to_regex(unfactored));
+  ASSERT_STRING_EQUALS("^(?:jo(?:hn(?: smith(?<=(?P<1>john smith))|(?<=(?P<2>john))| smyth(?<=(?P<3>john smyth)))|an)|(?:jo){2}|j(?:oe|ack))$", srgs_grammar_to_regex(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "john smyth", &interpretation));
+  ASSERT_STRING_EQUALS("102", interpretation);
+  srgs_parser_destroy(parser);
+}
+
+static const char *counted_repeat_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"account\">"
+  "  <rule id=\"account\" scope=\"public\">"
+  "    <item repeat=\"2-20\"><one-of><item>1</item><item>2</item></one-of>0</item>"
+  "    <item repeat=\"3-\"><tag>pound</tag>#</item>"
+  "  </rule>"
+  "</grammar>";
+
+/**
+ * Test wide repeat ranges
+ */
+static void test_counted_repeat(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_interpretation interpretation;
+  const char *tag;
+  char input[64];
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, counted_repeat_grammar)));
+  ASSERT_STRING_EQUALS("^(?:[12]0){2,20}(?P<1>#){3,}$", srgs_grammar_to_regex(grammar));
+  ASSERT_NOT_NULL(strstr(srgs_grammar_to_jsgf(grammar), "<_repeat1> = ( ( 1 ) | ( 2 ) ) 0;\n"));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "10###", &tag));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match(grammar, "1020##", &tag));
+  ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match(grammar, "1020###", &tag));
+  ASSERT_STRING_EQUALS("pound", tag);
+  ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match_interpretation(grammar, "102010####", &interpretation));
+  ASSERT_EQUALS(9, interpretation.offset);
+  ASSERT_EQUALS(1, interpretation.length);
+
+  /* 20 repeats are allowed, 21 are not */
+  for (i = 0; i < 20; i++) {
+    strcpy(input + i * 2, "20");
+  }
+  strcpy(input + 40, "###");
+  ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match(grammar, input, &tag));
+  strcpy(input + 40, "20###");
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, input, &tag));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  srgs_parser_destroy(parser);
+}
+
+static const char *set_menu_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"menu\">"
+  "  <rule id=\"menu\" scope=\"public\">"
+  "    <one-of>"
+  "      <item>0<tag>menu-0</tag></item>"
+  "      <item>1<tag>menu-1</tag></item>"
+  "    </one-of>"
+  "  </rule>"
+  "</grammar>";
+
+static const char *set_operator_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"operator\">"
+  "  <rule id=\"operator\" scope=\"public\">"
+  "    <item>0<tag>operator</tag></item>"
+  "  </rule>"
+  "</grammar>";
+
+static const char *set_extension_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"extension\">"
+  "  <rule id=\"extension\" scope=\"public\">"
+  "    <item repeat=\"1-4\"><tag>extension</tag><one-of><item>0</item><item>1</item><item>2</item><item>3</item></one-of></item>"
+  "  </rule>"
+  "</grammar>";
+
+/**
+ * Test matching several grammars at once
+ */
+static void test_grammar_set(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammars[3];
+  struct srgs_grammar_set *set;
+  struct srgs_grammar_set_session *session;
+  struct srgs_grammar_set_result results[3];
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammars[0] = srgs_parse(parser, set_menu_grammar)));
+  ASSERT_NOT_NULL((grammars[1] = srgs_parse(parser, set_operator_grammar)));
+  ASSERT_NOT_NULL((grammars[2] = srgs_parse(parser, set_extension_grammar)));
+  ASSERT_NOT_NULL((set = srgs_grammar_set_new(grammars, 3)));
+
+  /* complete matches first, ties in set order */
+  ASSERT_EQUALS(3, srgs_grammar_set_match(set, "0", results));
+  ASSERT_EQUALS(1, results[0].grammar == grammars[0]);
+  ASSERT_EQUALS(SMT_MATCH_END, results[0].match);
+  ASSERT_STRING_EQUALS("menu-0", results[0].interpretation);
+  ASSERT_EQUALS(1, results[1].priority);
+  ASSERT_EQUALS(SMT_MATCH_END, results[1].match);
+  ASSERT_STRING_EQUALS("operator", results[1].interpretation);
+  ASSERT_EQUALS(2, results[2].priority);
+  ASSERT_EQUALS(SMT_MATCH, results[2].match);
+  ASSERT_STRING_EQUALS("extension", results[2].interpretation);
+  ASSERT_EQUALS(1, srgs_grammar_set_match(set, "123", results));
+  ASSERT_EQUALS(2, results[0].priority);
+  ASSERT_EQUALS(0, srgs_grammar_set_match(set, "12345", results));
+  ASSERT_EQUALS(0, srgs_grammar_set_match(set, "", results));
+
+  ASSERT_NOT_NULL((session = srgs_grammar_set_session_new(set)));
+  ASSERT_EQUALS(2, srgs_grammar_set_session_feed_digit(session, '1', results));
+  ASSERT_EQUALS(0, results[0].priority);
+  ASSERT_EQUALS(SMT_MATCH_END, results[0].match);
+  ASSERT_EQUALS(2, results[1].priority);
+  ASSERT_EQUALS(1, srgs_grammar_set_session_feed_digit(session, '2', results));
+  ASSERT_EQUALS(1, srgs_grammar_set_session_feed_digit(session, '3', results));
+  ASSERT_EQUALS(1, srgs_grammar_set_session_feed_digit(session, '0', results));
+  ASSERT_EQUALS(SMT_MATCH_END, results[0].match);
+  ASSERT_EQUALS(0, srgs_grammar_set_session_feed_digit(session, '0', results));
+  srgs_grammar_set_session_reset(session);
+  ASSERT_EQUALS(3, srgs_grammar_set_session_feed_digit(session, '0', results));
+  srgs_grammar_set_session_destroy(session);
+
+  srgs_grammar_set_destroy(set);
+  srgs_parser_destroy(parser);
+}
+
+#define BATCH_INPUTS 2000
+
+/**
+ * Test matching many inputs at once
+ */
+static void test_match_batch(void)
+{
+  static const char *digits[] = { "1", "12", "1234#", "*", "5", "", "99", "#", "1234567890123#", NULL, "7#" };
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_match_result *results;
+  const char **inputs;
+  int engine;
+  int simd;
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  inputs = (const char **)malloc(sizeof(const char *) * BATCH_INPUTS);
+  results = (struct srgs_match_result *)malloc(sizeof(struct srgs_match_result) * BATCH_INPUTS);
+  for (i = 0; i < BATCH_INPUTS; i++) {
+    inputs[i] = digits[i % (sizeof(digits) / sizeof(digits[0]))];
+  }
+  for (engine = SME_PCRE; engine <= SME_GLUSHKOV; engine++) {
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, (enum srgs_match_engine)engine));
+    for (simd = 0; simd <= 1; simd++) {
+      srgs_set_simd(simd);
+      ASSERT_EQUALS(1, srgs_grammar_match_batch(grammar, inputs, BATCH_INPUTS, results, 4));
+      for (i = 0; i < BATCH_INPUTS; i++) {
+        struct srgs_interpretation interpretation;
+        enum srgs_match_type match = srgs_grammar_match_interpretation(grammar, inputs[i], &interpretation);
+        if (match != results[i].match || interpretation.tag != results[i].interpretation.tag ||
+            interpretation.offset != results[i].interpretation.offset || interpretation.length != results[i].interpretation.length) {
+          break;
+        }
+      }
+      ASSERT_EQUALS(BATCH_INPUTS, i);
+    }
+  }
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  srgs_set_simd(0);
+  ASSERT_EQUALS(0, srgs_grammar_match_batch(NULL, inputs, BATCH_INPUTS, results, 1));
+  free(inputs);
+  free(results);
+  srgs_parser_destroy(parser);
+}
+
+#define BATCH_BENCHMARK_INPUTS 1000000
+
+/**
+ * Compare batch match cost with and without vector instructions
+ */
+static void test_match_batch_benchmark(void)
+{
+  static const char *digits[] = { "1", "12", "1234#", "*", "5", "99", "#", "1234567890123#", "7#", "1234" };
+  static const char *menu_digits[] = { "1", "5", "7", "2", "0", "#", "9", "78" };
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_match_result *results;
+  const char **inputs;
+  int simd_available;
+  int simd;
+  int engine;
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+  inputs = (const char **)malloc(sizeof(const char *) * BATCH_BENCHMARK_INPUTS);
+  results = (struct srgs_match_result *)malloc(sizeof(struct srgs_match_result) * BATCH_BENCHMARK_INPUTS);
+  for (i = 0; i < BATCH_BENCHMARK_INPUTS; i++) {
+    inputs[i] = digits[i % (sizeof(digits) / sizeof(digits[0]))];
+  }
+  simd_available = srgs_set_simd(1);
+  for (simd = 0; simd <= 1; simd++) {
+    clock_t start;
+    srgs_set_simd(simd);
+    start = clock();
+    ASSERT_EQUALS(1, srgs_grammar_match_batch(grammar, inputs, BATCH_BENCHMARK_INPUTS, results, 1));
+    printf("BENCH\tmatch_batch rayo_example\t%s%s %.1f ns/input\n", simd ? "simd" : "scalar",
+      simd && !simd_available ? " (unavailable)" : "", (double)(clock() - start) * 1000000000.0 / CLOCKS_PER_SEC / BATCH_BENCHMARK_INPUTS);
+  }
+  srgs_set_simd(0);
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+
+  /* every hit has an interpretation to find */
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  for (i = 0; i < BATCH_BENCHMARK_INPUTS; i++) {
+    inputs[i] = menu_digits[i % (sizeof(menu_digits) / sizeof(menu_digits[0]))];
+  }
+  for (engine = SME_DFA; engine <= SME_NFA; engine++) {
+    clock_t start;
+    double batch;
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, (enum srgs_match_engine)engine));
+    start = clock();
+    ASSERT_EQUALS(1, srgs_grammar_match_batch(grammar, inputs, BATCH_BENCHMARK_INPUTS, results, 1));
+    batch = (double)(clock() - start) * 1000000000.0 / CLOCKS_PER_SEC / BATCH_BENCHMARK_INPUTS;
+    start = clock();
+    for (i = 0; i < BATCH_BENCHMARK_INPUTS; i++) {
+      srgs_grammar_match_interpretation(grammar, inputs[i], &results[i].interpretation);
+    }
+    printf("BENCH\tmatch_batch adhearsion_menu\t%s batch %.1f ns/input\tone at a time %.1f ns/input\n", engine == SME_DFA ? "dfa" : "nfa",
+      batch, (double)(clock() - start) * 1000000000.0 / CLOCKS_PER_SEC / BATCH_BENCHMARK_INPUTS);
+  }
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  free(inputs);
+  free(results);
+  srgs_parser_destroy(parser);
+}
+
+#define MANY_TAGS 100
+
+/**
+ * Test a grammar with more <tag>s than the regex has captures for
+ */
+static void test_many_tags(void)
+{
+  static const char *header =
+    "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"options\">"
+    "<rule id=\"options\" scope=\"public\"><item>*</item><one-of>";
+  static const char *footer = "</one-of><item repeat=\"0-1\">#</item></rule></grammar>";
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_interpretation interpretation;
+  char *document;
+  char *end;
+  int engine;
+  int i;
+
+  document = (char *)malloc(strlen(header) + strlen(footer) + MANY_TAGS * 64);
+  end = document + sprintf(document, "%s", header);
+  for (i = 0; i < MANY_TAGS; i++) {
+    end += sprintf(end, "<item>%i<tag>option %i</tag></item>", i, i);
+  }
+  sprintf(end, "%s", footer);
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, document)));
+  ASSERT_NULL(strstr(srgs_grammar_to_regex(grammar), "(?P<"));
+  for (engine = SME_PCRE; engine <= SME_GLUSHKOV; engine++) {
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, (enum srgs_match_engine)engine));
+    ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match_interpretation(grammar, "*5", &interpretation));
+    ASSERT_STRING_EQUALS("option 5", interpretation.tag);
+    ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match_interpretation(grammar, "*57#", &interpretation));
+    ASSERT_STRING_EQUALS("option 57", interpretation.tag);
+    ASSERT_EQUALS(1, interpretation.offset);
+    ASSERT_EQUALS(2, interpretation.length);
+    ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match_interpretation(grammar, "*99", &interpretation));
+    ASSERT_STRING_EQUALS("option 99", interpretation.tag);
+    ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match_interpretation(grammar, "*", &interpretation));
+    ASSERT_NULL(interpretation.tag);
+    ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match_interpretation(grammar, "*100", &interpretation));
+  }
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  srgs_parser_destroy(parser);
+  free(document);
+}
+
+static const char *long_input_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"digits\">"
+  "  <rule id=\"digits\" scope=\"public\">\n"
+  "    <item repeat=\"1-\"><one-of><item>0</item><item>1</item><item>2</item></one-of></item>\n"
+  "    <item>#<tag>done</tag></item>\n"
+  "  </rule>\n"
+  "</grammar>\n";
+
+/* the DFA needs a state per last 16 inputs */
+static const char *wide_dfa_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"digits\">"
+  "  <rule id=\"digits\" scope=\"public\">\n"
+  "    <item repeat=\"0-\"><one-of><item>0</item><item>1</item></one-of></item>\n"
+  "    <item>1<tag>one</tag></item>\n"
+  "    <item repeat=\"15\"><one-of><item>0</item><item>1</item></one-of></item>\n"
+  "  </rule>\n"
+  "</grammar>\n";
+
+#define LONG_INPUT_SIZE 10000
+#define LONG_INPUT_CHUNK 999
+
+/**
+ * Test matching input longer than any fixed buffer, all at once and in chunks
+ */
+static void test_long_input(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_match_session *session;
+  const char *interpretation;
+  char *input;
+  int i;
+
+  input = (char *)malloc(LONG_INPUT_SIZE + 1);
+  for (i = 0; i < LONG_INPUT_SIZE; i++) {
+    input[i] = '0' + i % 3;
+  }
+  input[LONG_INPUT_SIZE - 1] = '#';
+  input[LONG_INPUT_SIZE] = '\0';
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, long_input_grammar)));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, input, &interpretation));
+  ASSERT_STRING_EQUALS("done", interpretation);
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  for (i = 0; i + LONG_INPUT_CHUNK < LONG_INPUT_SIZE - 1; i += LONG_INPUT_CHUNK) {
+    ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed(session, input + i, LONG_INPUT_CHUNK));
+  }
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed(session, input + i, LONG_INPUT_SIZE - i));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_result(session, &interpretation));
+  ASSERT_STRING_EQUALS("done", interpretation);
+  srgs_match_session_destroy(session);
+
+  /* too big for a DFA, the session simulates the program instead */
+  for (i = 0; i < LONG_INPUT_SIZE; i++) {
+    input[i] = '0' + i % 2;
+  }
+  input[LONG_INPUT_SIZE - 16] = '1';
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, wide_dfa_grammar)));
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed(session, input, 16));
+  /* no single digit makes the 15 digits after the 1 match again */
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed(session, input + 16, 1));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_result(session, &interpretation));
+  ASSERT_STRING_EQUALS("one", interpretation);
+  ASSERT_EQUALS(0x3, srgs_match_session_next_symbols(session));
+  for (i = 17; i + LONG_INPUT_CHUNK < LONG_INPUT_SIZE; i += LONG_INPUT_CHUNK) {
+    srgs_match_session_feed(session, input + i, LONG_INPUT_CHUNK);
+  }
+  /* 16th digit from the end is a 1 */
+  ASSERT_EQUALS(SMT_MATCH, srgs_match_session_feed(session, input + i, LONG_INPUT_SIZE - i));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_match_session_feed_digit(session, '2'));
+  srgs_match_session_reset(session);
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed(session, "1", 1));
+  srgs_match_session_destroy(session);
+
+  srgs_parser_destroy(parser);
+  free(input);
+}
+
+#define UNCOMPILABLE_RULES 17
+
+/**
+ * Test compiling grammars when they are parsed
+ */
+static void test_eager_compile(void)
+{
+  static const char *header =
+    "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"digits\">"
+    "<rule id=\"digits\"><item repeat=\"70000\"><ruleref uri=\"#r0\"/></item></rule>";
+  struct srgs_parser *parser;
+  struct srgs_parser *lazy_parser;
+  struct srgs_grammar *grammar;
+  const char *interpretation;
+  char *uncompilable_grammar;
+  char *end;
+  int i;
+
+  /* too many repeats for a PCRE quantifier and too many digits for a matcher program or DFA */
+  uncompilable_grammar = (char *)malloc(strlen(header) + UNCOMPILABLE_RULES * 128);
+  end = uncompilable_grammar + sprintf(uncompilable_grammar, "%s", header);
+  for (i = 0; i < UNCOMPILABLE_RULES; i++) {
+    end += sprintf(end, "<rule id=\"r%i\"><ruleref uri=\"#r%i\"/><ruleref uri=\"#r%i\"/></rule>", i, i + 1, i + 1);
+  }
+  sprintf(end, "<rule id=\"r%i\">1</rule></grammar>", UNCOMPILABLE_RULES);
+
+  parser = srgs_parser_new("1234");
+  srgs_parser_set_eager_compile(parser, 1);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1234#", &interpretation));
+  ASSERT_NULL(srgs_parse(parser, uncompilable_grammar));
+
+  /* parsed without compiling, then found in the cache */
+  lazy_parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(lazy_parser, uncompilable_grammar)));
+  ASSERT_NULL(srgs_parse(parser, uncompilable_grammar));
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "1", &interpretation));
+
+  srgs_parser_destroy(lazy_parser);
+  srgs_parser_destroy(parser);
+  free(uncompilable_grammar);
+}
+
+static const char *tiered_grammar =
+  "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"account\">"
+  "  <rule id=\"account\" scope=\"public\">\n"
+  "    <one-of>\n"
+  "      <item><item repeat=\"4\"><ruleref uri=\"#digit\"/></item><tag>short</tag></item>\n"
+  "      <item><item repeat=\"8\"><ruleref uri=\"#digit\"/></item><tag>long</tag></item>\n"
+  "    </one-of>\n"
+  "    #\n"
+  "  </rule>\n"
+  "  <rule id=\"digit\"><one-of><item>0</item><item>1</item><item>2</item><item>3</item><item>4</item>"
+  "<item>5</item><item>6</item><item>7</item><item>8</item><item>9</item></one-of></rule>\n"
+  "</grammar>\n";
+
+/**
+ * Check the matches of tiered_grammar
+ * @param grammar the parsed tiered_grammar
+ * @param session a session matching the grammar
+ */
+static void check_tiered_matches(struct srgs_grammar *grammar, struct srgs_match_session *session)
+{
+  static const char *inputs[] = { "1", "1234", "1234#", "12345678#", "123456789#", "#" };
+  static const enum srgs_match_type matches[] = { SMT_MATCH_PARTIAL, SMT_MATCH_PARTIAL, SMT_MATCH_END, SMT_MATCH_END, SMT_NO_MATCH, SMT_NO_MATCH };
+  struct srgs_interpretation interpretation;
+  int i;
+
+  for (i = 0; i < (int)(sizeof(inputs) / sizeof(inputs[0])); i++) {
+    ASSERT_EQUALS(matches[i], srgs_grammar_match_interpretation(grammar, inputs[i], &interpretation));
+  }
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match_interpretation(grammar, "12345678#", &interpretation));
+  ASSERT_STRING_EQUALS("long", interpretation.tag);
+  ASSERT_EQUALS(0, interpretation.offset);
+  ASSERT_EQUALS(8, interpretation.length);
+  ASSERT_EQUALS(0x7ff, srgs_grammar_next_symbols(grammar, "1234"));
+  ASSERT_EQUALS(0x3ff, srgs_grammar_next_symbols(grammar, "12345"));
+  srgs_match_session_reset(session);
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_match_session_feed(session, "1234", 4));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_match_session_feed_digit(session, '#'));
+}
+
+/**
+ * Test matching a grammar while it is compiled in the background and after
+ */
+static void test_tiered_compile(void)
+{
+  struct timespec wait = { 0, 10000000 };
+  struct srgs_parser *parser;
+  struct srgs_parser *untiered_parser;
+  struct srgs_grammar *grammar;
+  struct srgs_grammar *untiered;
+  struct srgs_match_session *session;
+  int i;
+
+  /* hold the background compile so the grammar is simulated */
+  srgs_set_upgrades_paused(1);
+  parser = srgs_parser_new("1234");
+  srgs_parser_set_tiered_compile(parser, 1);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, tiered_grammar)));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+  ASSERT_EQUALS(1, srgs_grammar_is_upgrading(grammar));
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  check_tiered_matches(grammar, session);
+  ASSERT_EQUALS(1, srgs_grammar_is_upgrading(grammar));
+  srgs_match_session_destroy(session);
+
+  /* other parsers don't share the tiered grammar */
+  untiered_parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((untiered = srgs_parse(untiered_parser, tiered_grammar)));
+  ASSERT_EQUALS(0, untiered == grammar);
+  ASSERT_EQUALS(0, srgs_grammar_is_upgrading(untiered));
+  srgs_parser_destroy(untiered_parser);
+
+  /* let the upgrade finish, then match with the optimized matchers */
+  srgs_set_upgrades_paused(0);
+  for (i = 0; i < 1000 && srgs_grammar_is_upgrading(grammar); i++) {
+    nanosleep(&wait, NULL);
+  }
+  ASSERT_EQUALS(0, srgs_grammar_is_upgrading(grammar));
+  ASSERT_NOT_NULL((session = srgs_match_session_new(grammar)));
+  check_tiered_matches(grammar, session);
+  ASSERT_EQUALS(1, srgs_grammar_freeze(grammar));
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  srgs_match_session_destroy(session);
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * Test stopping the background compile with grammars still queued.
+ * Tiered grammars are compiled by their first match afterwards, so this
+ * runs last.
+ */
+static void test_shutdown(void)
+{
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  const char *interpretation;
+
+  srgs_set_upgrades_paused(1);
+  parser = srgs_parser_new("1234");
+  srgs_parser_set_tiered_compile(parser, 1);
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, rayo_example_grammar)));
+  ASSERT_EQUALS(1, srgs_grammar_is_upgrading(grammar));
+
+  /* the queued grammar is released and matched as usual */
+  srgs_shutdown();
+  ASSERT_EQUALS(0, srgs_grammar_is_upgrading(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1234#", &interpretation));
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match(grammar, "27", &interpretation));
+
+  /* no more grammars are queued */
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(0, srgs_grammar_is_upgrading(grammar));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1", &interpretation));
+  srgs_set_upgrades_paused(0);
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * Test picking the engine from the shape of the grammar
+ */
+static void test_engine_selection(void)
+{
+  static const char *header =
+    "<grammar xmlns=\"http://www.w3.org/2001/06/grammar\" version=\"1.0\" xml:lang=\"en-US\" mode=\"dtmf\" root=\"digits\">"
+    "<rule id=\"digits\" scope=\"public\"><item repeat=\"0-\"><one-of><item>0</item><item>1</item></one-of></item><one-of>";
+  static const char *footer =
+    "</one-of><item repeat=\"15\"><one-of><item>0</item><item>1</item></one-of></item></rule></grammar>";
+  /* too many states for a DFA, without <tag>s, then with too many <tag>s for the regex,
+     then with too many positions for the Glushkov automaton */
+  static const int items[] = { MANY_TAGS, MANY_TAGS, MANY_TAGS * 3 };
+  static const int tagged[] = { 0, 1, 1 };
+  static const enum srgs_match_engine engines[] = { SME_GLUSHKOV, SME_NFA, SME_NFA };
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_interpretation interpretation;
+  char *document;
+  char *end;
+  int size;
+  int i;
+
+  parser = srgs_parser_new("1234");
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, adhearsion_menu_grammar)));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match_interpretation(grammar, "1", &interpretation));
+  ASSERT_EQUALS(SME_DFA, srgs_grammar_get_engine(grammar));
+
+  for (size = 0; size < (int)(sizeof(items) / sizeof(items[0])); size++) {
+    document = (char *)malloc(strlen(header) + strlen(footer) + items[size] * 64);
+    end = document + sprintf(document, "%s", header);
+    for (i = 0; i < items[size]; i++) {
+      if (tagged[size]) {
+        end += sprintf(end, "<item>1<tag>one %i</tag></item>", i);
+      } else {
+        end += sprintf(end, "<item>1</item>");
+      }
+    }
+    sprintf(end, "%s", footer);
+    ASSERT_NOT_NULL((grammar = srgs_parse(parser, document)));
+    /* the engine is picked on the first match, not when asked for */
+    ASSERT_EQUALS(SME_AUTO, srgs_grammar_get_engine(grammar));
+    ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match_interpretation(grammar, "100000000000000", &interpretation));
+    ASSERT_EQUALS(engines[size], srgs_grammar_get_engine(grammar));
+    ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match_interpretation(grammar, "0011000000000000000", &interpretation));
+    if (tagged[size]) {
+      ASSERT_STRING_EQUALS("one 0", interpretation.tag);
+      ASSERT_EQUALS(3, interpretation.offset);
+      ASSERT_EQUALS(1, interpretation.length);
+    } else {
+      ASSERT_NULL(interpretation.tag);
+    }
+
+    /* override for testing, then pick again */
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+    ASSERT_EQUALS(SME_DFA, srgs_grammar_get_engine(grammar));
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+    ASSERT_EQUALS(engines[size], srgs_grammar_get_engine(grammar));
+    free(document);
+  }
+
+  srgs_parser_destroy(parser);
+}
+
+/**
+ * Test the bit-parallel Glushkov engine against the DFA
+ */
+static void test_glushkov_engine(void)
+{
+  static const char *documents[] = { adhearsion_menu_grammar, adhearsion_ask_grammar, rayo_example_grammar, repeat_item_range_ambiguous_grammar };
+  struct srgs_parser *parser;
+  struct srgs_grammar *grammar;
+  struct srgs_interpretation dfa_interpretation;
+  struct srgs_interpretation interpretation;
+  const char *tag;
+  char *input;
+  int i;
+  int j;
+
+  parser = srgs_parser_new("1234");
+  for (i = 0; i < (int)(sizeof(documents) / sizeof(documents[0])); i++) {
+    ASSERT_NOT_NULL((grammar = srgs_parse(parser, documents[i])));
+    for (j = 0; engine_test_inputs[j]; j++) {
+      enum srgs_match_type match;
+      ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_DFA));
+      match = srgs_grammar_match_interpretation(grammar, engine_test_inputs[j], &dfa_interpretation);
+      ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_GLUSHKOV));
+      ASSERT_EQUALS(SME_GLUSHKOV, srgs_grammar_get_engine(grammar));
+      ASSERT_EQUALS(match, srgs_grammar_match_interpretation(grammar, engine_test_inputs[j], &interpretation));
+      if (dfa_interpretation.tag) {
+        ASSERT_STRING_EQUALS(dfa_interpretation.tag, interpretation.tag);
+        ASSERT_EQUALS(dfa_interpretation.offset, interpretation.offset);
+        ASSERT_EQUALS(dfa_interpretation.length, interpretation.length);
+      } else {
+        ASSERT_NULL(interpretation.tag);
+      }
+    }
+    ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+  }
+
+  /* no DFA - any input with a 1 16 digits from the end */
+  input = (char *)malloc(LONG_INPUT_SIZE + 1);
+  for (i = 0; i < LONG_INPUT_SIZE; i++) {
+    input[i] = '0' + i % 2;
+  }
+  input[LONG_INPUT_SIZE - 16] = '1';
+  input[LONG_INPUT_SIZE] = '\0';
+  ASSERT_NOT_NULL((grammar = srgs_parse(parser, wide_dfa_grammar)));
+  /* the grammar has a <tag>, so the Glushkov automaton is only used when asked for */
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_GLUSHKOV));
+  ASSERT_EQUALS(SMT_MATCH_END, srgs_grammar_match(grammar, "1000000000000000", &tag));
+  ASSERT_STRING_EQUALS("one", tag);
+  ASSERT_EQUALS(SMT_MATCH_PARTIAL, srgs_grammar_match(grammar, "100000000000000", &tag));
+  ASSERT_NULL(tag);
+  ASSERT_EQUALS(SMT_NO_MATCH, srgs_grammar_match(grammar, "10000000000000002", &tag));
+  ASSERT_EQUALS(SMT_MATCH, srgs_grammar_match_interpretation(grammar, input, &interpretation));
+  ASSERT_STRING_EQUALS("one", interpretation.tag);
+  ASSERT_EQUALS(LONG_INPUT_SIZE - 16, interpretation.offset);
+  ASSERT_EQUALS(1, interpretation.length);
+  ASSERT_EQUALS(1, srgs_grammar_set_engine(grammar, SME_AUTO));
+
+  srgs_parser_destroy(parser);
+  free(input);
+}
+
 /**
  * main program
  */
@@ -1091,5 +2543,29 @@ int test_srgs()
   TEST(test_metadata_grammar);
   TEST(test_repeat_item_range_ambiguous_grammar);
   TEST(test_repeat_item_range_optional_pound_grammar);
+  TEST(test_match_dfa_engine);
+  TEST(test_match_session);
+  TEST(test_next_symbols);
+  TEST(test_match_interpretation);
+  TEST(test_match_jit_benchmark);
+  TEST(test_frozen_grammar);
+  TEST(test_concurrent_parse);
+  TEST(test_grammar_cache);
+  TEST(test_large_one_of);
+  TEST(test_resolve_refs);
+  TEST(test_regex_subroutines);
+  TEST(test_simplify);
+  TEST(test_regex_prefix_factoring);
+  TEST(test_counted_repeat);
+  TEST(test_grammar_set);
+  TEST(test_match_batch);
+  TEST(test_match_batch_benchmark);
+  TEST(test_many_tags);
+  TEST(test_long_input);
+  TEST(test_eager_compile);
+  TEST(test_tiered_compile);
+  TEST(test_engine_selection);
+  TEST(test_glushkov_engine);
+  TEST(test_shutdown);
   return 0;
 }